@@ -81,8 +81,8 @@ goto :eof
 
 :c89
 if not exist "%BUILD_DIR%\c89" mkdir "%BUILD_DIR%\c89"
-where gcc >nul 2>nul && gcc -std=c89 -O2 -o "%BUILD_DIR%\c89\omi.exe" "%ROOT_DIR%omi.c" -lsqlite3 && goto :eof
-where clang >nul 2>nul && clang -std=c89 -O2 -o "%BUILD_DIR%\c89\omi.exe" "%ROOT_DIR%omi.c" -lsqlite3 && goto :eof
+where gcc >nul 2>nul && gcc -std=c89 -O2 -o "%BUILD_DIR%\c89\omi.exe" "%ROOT_DIR%omi.c" "%ROOT_DIR%libomi.c" -lsqlite3 && goto :eof
+where clang >nul 2>nul && clang -std=c89 -O2 -o "%BUILD_DIR%\c89\omi.exe" "%ROOT_DIR%omi.c" "%ROOT_DIR%libomi.c" -lsqlite3 && goto :eof
 echo No C compiler found (gcc/clang). Skipping C89 build.
 goto :eof
 
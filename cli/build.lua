@@ -34,9 +34,9 @@ end
 local function build_c89()
   mkdir(build .. "/c89")
   if os.execute("gcc --version > /dev/null 2>&1") == 0 then
-    run(string.format("gcc -std=c89 -O2 -o %q %q -lsqlite3", build .. "/c89/omi", root .. "/omi.c"))
+    run(string.format("gcc -std=c89 -O2 -o %q %q %q -lsqlite3", build .. "/c89/omi", root .. "/omi.c", root .. "/libomi.c"))
   elseif os.execute("clang --version > /dev/null 2>&1") == 0 then
-    run(string.format("clang -std=c89 -O2 -o %q %q -lsqlite3", build .. "/c89/omi", root .. "/omi.c"))
+    run(string.format("clang -std=c89 -O2 -o %q %q %q -lsqlite3", build .. "/c89/omi", root .. "/omi.c", root .. "/libomi.c"))
   else
     print("No C compiler found (gcc/clang). Skipping C89 build.")
   end
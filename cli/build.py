@@ -44,9 +44,9 @@ def build_c89():
     target_dir = os.path.join(BUILD_DIR, "c89")
     mkdir(target_dir)
     if has_cmd("gcc"):
-        return run(["gcc", "-std=c89", "-O2", "-o", os.path.join(target_dir, "omi"), os.path.join(ROOT_DIR, "omi.c"), "-lsqlite3"])
+        return run(["gcc", "-std=c89", "-O2", "-o", os.path.join(target_dir, "omi"), os.path.join(ROOT_DIR, "omi.c"), os.path.join(ROOT_DIR, "libomi.c"), "-lsqlite3"])
     if has_cmd("clang"):
-        return run(["clang", "-std=c89", "-O2", "-o", os.path.join(target_dir, "omi"), os.path.join(ROOT_DIR, "omi.c"), "-lsqlite3"])
+        return run(["clang", "-std=c89", "-O2", "-o", os.path.join(target_dir, "omi"), os.path.join(ROOT_DIR, "omi.c"), os.path.join(ROOT_DIR, "libomi.c"), "-lsqlite3"])
     print("No C compiler found (gcc/clang). Skipping C89 build.")
     return False
 
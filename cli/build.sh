@@ -37,15 +37,62 @@ build_haxe() {
   esac
 }
 
+has_header() {
+  echo "#include <$1>" | $cc -E - >/dev/null 2>&1
+}
+
+# Internal HTTP and gzip uploads when the libcurl and zlib headers are there;
+# OMI_LIBCURL=0 builds a client that always runs the external curl.
+use_libcurl() {
+  [ "${OMI_LIBCURL:-1}" != "0" ] && has_header curl/curl.h
+}
+
+use_zlib() {
+  use_libcurl && has_header zlib.h
+}
+
+c89_flags() {
+  # io_uring reader on Linux when the kernel headers know IORING_OP_STATX (5.6+);
+  # omi falls back to stdio at runtime if the running kernel refuses it.
+  if [ "$(uname -s)" = "Linux" ] && grep -q IORING_OP_STATX /usr/include/linux/io_uring.h 2>/dev/null; then
+    echo "-DUSE_IO_URING"
+  fi
+  if use_libcurl; then
+    # curl_formadd is deprecated in newer libcurl but still works everywhere
+    echo "-DUSE_LIBCURL -DCURL_DISABLE_DEPRECATION"
+  fi
+  if use_zlib; then
+    echo "-DUSE_ZLIB"
+  fi
+}
+
+c89_libs() {
+  echo "-lsqlite3"
+  if use_libcurl; then
+    echo "-lcurl"
+  fi
+  if use_zlib; then
+    echo "-lz"
+  fi
+}
+
 build_c89() {
   mkdir -p "$BUILD_DIR/c89"
   if has_cmd gcc; then
-    gcc -std=c89 -O2 -o "$BUILD_DIR/c89/omi" "$ROOT_DIR/omi.c" -lsqlite3
+    cc=gcc
   elif has_cmd clang; then
-    clang -std=c89 -O2 -o "$BUILD_DIR/c89/omi" "$ROOT_DIR/omi.c" -lsqlite3
+    cc=clang
   else
     echo "No C compiler found (gcc/clang). Skipping C89 build."
+    return
   fi
+  # libomi.a + omi.h for embedding; the omi tool links against the same archive
+  $cc -std=c89 -O2 $(c89_flags) -c -o "$BUILD_DIR/c89/libomi.o" "$ROOT_DIR/libomi.c"
+  ar rcs "$BUILD_DIR/c89/libomi.a" "$BUILD_DIR/c89/libomi.o"
+  # libomi.so for dynamic linking; position-independent, so a separate object
+  $cc -std=c89 -O2 -fPIC -shared $(c89_flags) -o "$BUILD_DIR/c89/libomi.so" "$ROOT_DIR/libomi.c" $(c89_libs)
+  cp "$ROOT_DIR/omi.h" "$BUILD_DIR/c89/omi.h"
+  $cc -std=c89 -O2 -o "$BUILD_DIR/c89/omi" "$ROOT_DIR/omi.c" "$BUILD_DIR/c89/libomi.a" $(c89_libs)
 }
 
 build_csharp() {
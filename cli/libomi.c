@@ -0,0 +1,4538 @@
+/*
+ * libomi - Omi repository library (C89)
+ * Cross-platform (AmigaOS, Windows, macOS, BSD, Linux)
+ * Public API in omi.h; the omi command line tool is a thin wrapper.
+ */
+
+#if defined(USE_IO_URING) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
+/* snprintf, vsnprintf and popen are C99/POSIX: strict C89 mode hides them */
+#if defined(__STRICT_ANSI__) && !defined(_GNU_SOURCE) && !defined(_POSIX_C_SOURCE) \
+    && !defined(_WIN32) && !defined(_WIN64)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sqlite3.h>
+
+#include "omi.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#define OMI_WINDOWS 1
+#include <windows.h>
+#include <direct.h>
+#else
+#define OMI_POSIX 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef AMIGA
+#define OMI_AMIGA 1
+#endif
+
+#ifdef USE_LIBCURL
+#include <curl/curl.h>
+#endif
+
+/* Compressed uploads need both: zlib deflates while libcurl sends */
+#if defined(USE_LIBCURL) && defined(USE_ZLIB)
+#define OMI_GZIP_UPLOAD 1
+#include <zlib.h>
+#endif
+
+#ifdef USE_IO_URING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#endif
+
+#define MAX_LINE 1024
+#define MAX_PATH_LEN OMI_MAX_PATH
+#define MAX_SMALL OMI_MAX_SMALL
+
+/* Repository format 1 stored hashes as hex TEXT, format 2 as BLOB keys */
+#define OMI_FORMAT_VERSION 2
+
+/* Matches a hash column against bound raw hash p in either representation:
+ * format 1 rows and rows other clients add to format 2 hold hex TEXT */
+#define OMI_HASH_IN(p) "IN (" p ", lower(hex(" p ")))"
+
+/* Blobs stored as a delta: blobs.data is NULL and size stays the full size */
+#define OMI_DELTAS_SQL \
+    "CREATE TABLE IF NOT EXISTS deltas (hash BLOB PRIMARY KEY, base BLOB NOT NULL, " \
+    "depth INTEGER NOT NULL, data BLOB NOT NULL) WITHOUT ROWID"
+
+/* How far each staging journal has been merged; journals themselves are
+ * found by file name and record their own closed flag */
+#define OMI_JOURNALS_SQL \
+    "CREATE TABLE IF NOT EXISTS journals (name TEXT PRIMARY KEY, merged INTEGER NOT NULL DEFAULT 0)"
+
+typedef unsigned int u32;
+typedef unsigned char u8;
+
+void omi_settings_init(OmiSettings *s) {
+    memset(s, 0, sizeof(OmiSettings));
+    strcpy(s->curl, "curl");
+    strcpy(s->api_enabled, "1");
+    s->use_internal_http = 1;
+    s->http_timeout = 30;
+    s->compression = 1;
+}
+
+void omi_settings_load(OmiSettings *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[MAX_LINE];
+
+    if (!f) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *eq;
+        char *key;
+        char *value;
+
+        if (line[0] == '#') {
+            continue;
+        }
+
+        eq = strchr(line, '=');
+        if (!eq) {
+            continue;
+        }
+
+        *eq = '\0';
+        key = line;
+        value = eq + 1;
+
+        while (*value && (*value == ' ' || *value == '\t')) value++;
+        value[strcspn(value, "\r\n")] = '\0';
+
+        if (strcmp(key, "USERNAME") == 0) {
+            strncpy(s->username, value, MAX_SMALL - 1);
+        } else if (strcmp(key, "PASSWORD") == 0) {
+            strncpy(s->password, value, MAX_SMALL - 1);
+        } else if (strcmp(key, "REPOS") == 0) {
+            strncpy(s->repos, value, MAX_PATH_LEN - 1);
+        } else if (strcmp(key, "CURL") == 0) {
+            strncpy(s->curl, value, MAX_SMALL - 1);
+        } else if (strcmp(key, "API_ENABLED") == 0) {
+            strncpy(s->api_enabled, value, MAX_SMALL - 1);
+        } else if (strcmp(key, "USE_INTERNAL_HTTP") == 0) {
+            s->use_internal_http = (strcmp(value, "1") == 0);
+        } else if (strcmp(key, "HTTP_TIMEOUT") == 0) {
+            s->http_timeout = atoi(value);
+        } else if (strcmp(key, "COMPRESSION") == 0) {
+            s->compression = (strcmp(value, "0") != 0);
+        } else if (strcmp(key, "DELTA_CHAIN") == 0) {
+            s->delta_chain = atoi(value);
+        }
+    }
+
+    fclose(f);
+}
+
+static int file_exists(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        fclose(f);
+        return 1;
+    }
+    return 0;
+}
+
+void omi_write_dotomi(const char *db_name) {
+    FILE *f = fopen(".omi", "w");
+    if (!f) return;
+    fprintf(f, "OMI_DB=\"%s\"\n", db_name);
+    fclose(f);
+}
+
+void omi_read_dotomi(char *out_db, size_t out_len) {
+    FILE *f = fopen(".omi", "r");
+    char line[MAX_LINE];
+
+    if (!f) {
+        strncpy(out_db, "repo.omi", out_len - 1);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *start = strstr(line, "OMI_DB=\"");
+        if (start) {
+            start += strlen("OMI_DB=\"");
+            start[strcspn(start, "\"\r\n")] = '\0';
+            strncpy(out_db, start, out_len - 1);
+            fclose(f);
+            return;
+        }
+    }
+
+    fclose(f);
+    strncpy(out_db, "repo.omi", out_len - 1);
+}
+
+/* Library messages; omi_set_output() redirects or silences them */
+static FILE *out_info = NULL;
+static FILE *out_err = NULL;
+static int out_redirected = 0;
+
+void omi_set_output(FILE *info, FILE *err) {
+    out_info = info;
+    out_err = err;
+    out_redirected = 1;
+}
+
+static void omi_info(const char *fmt, ...) {
+    FILE *f = out_redirected ? out_info : stdout;
+    va_list ap;
+
+    if (!f) return;
+    va_start(ap, fmt);
+    vfprintf(f, fmt, ap);
+    va_end(ap);
+}
+
+static void omi_warn(const char *fmt, ...) {
+    FILE *f = out_redirected ? out_err : stderr;
+    va_list ap;
+
+    if (!f) return;
+    fputs("Error: ", f);
+    va_start(ap, fmt);
+    vfprintf(f, fmt, ap);
+    va_end(ap);
+    fputc('\n', f);
+}
+
+/* SHA256 implementation (C89) */
+
+typedef struct {
+    u32 state[8];
+    u32 bitlen[2];
+    u8 data[64];
+    u32 datalen;
+} SHA256_CTX;
+
+static u32 sha_rotr(u32 a, u32 b) { return ((a >> b) | (a << (32 - b))); }
+static u32 sha_ch(u32 x, u32 y, u32 z) { return (x & y) ^ (~x & z); }
+static u32 sha_maj(u32 x, u32 y, u32 z) { return (x & y) ^ (x & z) ^ (y & z); }
+static u32 sha_ep0(u32 x) { return sha_rotr(x, 2) ^ sha_rotr(x, 13) ^ sha_rotr(x, 22); }
+static u32 sha_ep1(u32 x) { return sha_rotr(x, 6) ^ sha_rotr(x, 11) ^ sha_rotr(x, 25); }
+static u32 sha_sig0(u32 x) { return sha_rotr(x, 7) ^ sha_rotr(x, 18) ^ (x >> 3); }
+static u32 sha_sig1(u32 x) { return sha_rotr(x, 17) ^ sha_rotr(x, 19) ^ (x >> 10); }
+
+static const u32 sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_transform(SHA256_CTX *ctx, const u8 data[]) {
+    u32 a, b, c, d, e, f, g, h, i, t1, t2, m[64];
+
+    for (i = 0; i < 16; ++i) {
+        m[i] = (data[i * 4] << 24) | (data[i * 4 + 1] << 16)
+             | (data[i * 4 + 2] << 8) | (data[i * 4 + 3]);
+    }
+    for (i = 16; i < 64; ++i) {
+        m[i] = sha_sig1(m[i - 2]) + m[i - 7] + sha_sig0(m[i - 15]) + m[i - 16];
+    }
+
+    a = ctx->state[0];
+    b = ctx->state[1];
+    c = ctx->state[2];
+    d = ctx->state[3];
+    e = ctx->state[4];
+    f = ctx->state[5];
+    g = ctx->state[6];
+    h = ctx->state[7];
+
+    for (i = 0; i < 64; ++i) {
+        t1 = h + sha_ep1(e) + sha_ch(e, f, g) + sha_k[i] + m[i];
+        t2 = sha_ep0(a) + sha_maj(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+static void sha256_init(SHA256_CTX *ctx) {
+    ctx->datalen = 0;
+    ctx->bitlen[0] = 0;
+    ctx->bitlen[1] = 0;
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+}
+
+static void sha256_update(SHA256_CTX *ctx, const u8 data[], size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        ctx->data[ctx->datalen] = data[i];
+        ctx->datalen++;
+        if (ctx->datalen == 64) {
+            sha256_transform(ctx, ctx->data);
+            if (ctx->bitlen[0] > 0xffffffff - 512) {
+                ctx->bitlen[1]++;
+            }
+            ctx->bitlen[0] += 512;
+            ctx->datalen = 0;
+        }
+    }
+}
+
+static void sha256_final(SHA256_CTX *ctx, u8 hash[]) {
+    u32 i = ctx->datalen;
+    u32 bitlen_low;
+    u32 bitlen_high;
+
+    if (ctx->datalen < 56) {
+        ctx->data[i++] = 0x80;
+        while (i < 56) ctx->data[i++] = 0x00;
+    } else {
+        ctx->data[i++] = 0x80;
+        while (i < 64) ctx->data[i++] = 0x00;
+        sha256_transform(ctx, ctx->data);
+        memset(ctx->data, 0, 56);
+    }
+
+    bitlen_high = ctx->bitlen[1];
+    bitlen_low = ctx->bitlen[0] + ctx->datalen * 8;
+
+    ctx->data[63] = (u8)(bitlen_low);
+    ctx->data[62] = (u8)(bitlen_low >> 8);
+    ctx->data[61] = (u8)(bitlen_low >> 16);
+    ctx->data[60] = (u8)(bitlen_low >> 24);
+    ctx->data[59] = (u8)(bitlen_high);
+    ctx->data[58] = (u8)(bitlen_high >> 8);
+    ctx->data[57] = (u8)(bitlen_high >> 16);
+    ctx->data[56] = (u8)(bitlen_high >> 24);
+
+    sha256_transform(ctx, ctx->data);
+
+    for (i = 0; i < 4; ++i) {
+        hash[i]      = (u8)((ctx->state[0] >> (24 - i * 8)) & 0xff);
+        hash[i + 4]  = (u8)((ctx->state[1] >> (24 - i * 8)) & 0xff);
+        hash[i + 8]  = (u8)((ctx->state[2] >> (24 - i * 8)) & 0xff);
+        hash[i + 12] = (u8)((ctx->state[3] >> (24 - i * 8)) & 0xff);
+        hash[i + 16] = (u8)((ctx->state[4] >> (24 - i * 8)) & 0xff);
+        hash[i + 20] = (u8)((ctx->state[5] >> (24 - i * 8)) & 0xff);
+        hash[i + 24] = (u8)((ctx->state[6] >> (24 - i * 8)) & 0xff);
+        hash[i + 28] = (u8)((ctx->state[7] >> (24 - i * 8)) & 0xff);
+    }
+}
+
+static void sha256_digest(const u8 *data, size_t len, u8 out_hash[OMI_HASH_LEN]) {
+    SHA256_CTX ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out_hash);
+}
+
+/* Hashes are stored as 32-byte BLOBs; hex is only for display. */
+void omi_hash_hex(const unsigned char *hash, char *out_hex, size_t out_len) {
+    size_t i;
+    const char *hex = "0123456789abcdef";
+
+    if (out_len < OMI_HASH_LEN * 2 + 1) return;
+
+    for (i = 0; i < OMI_HASH_LEN; ++i) {
+        out_hex[i * 2] = hex[(hash[i] >> 4) & 0x0f];
+        out_hex[i * 2 + 1] = hex[hash[i] & 0x0f];
+    }
+    out_hex[OMI_HASH_LEN * 2] = '\0';
+}
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int hex_to_hash(const char *hex, size_t hex_len, u8 out_hash[OMI_HASH_LEN]) {
+    size_t i;
+
+    if (hex_len != OMI_HASH_LEN * 2) return 0;
+
+    for (i = 0; i < OMI_HASH_LEN; ++i) {
+        int hi = hex_digit((unsigned char)hex[i * 2]);
+        int lo = hex_digit((unsigned char)hex[i * 2 + 1]);
+        if (hi < 0 || lo < 0) return 0;
+        out_hash[i] = (u8)((hi << 4) | lo);
+    }
+    return 1;
+}
+
+static int load_file(const char *path, u8 **out_data, size_t *out_len) {
+    FILE *f = fopen(path, "rb");
+    long len;
+    u8 *data;
+
+    if (!f) return 0;
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (len <= 0) {
+        fclose(f);
+        return 0;
+    }
+
+    data = (u8 *)malloc((size_t)len);
+    if (!data) {
+        fclose(f);
+        return 0;
+    }
+
+    if (fread(data, 1, (size_t)len, f) != (size_t)len) {
+        free(data);
+        fclose(f);
+        return 0;
+    }
+
+    fclose(f);
+    *out_data = data;
+    *out_len = (size_t)len;
+    return 1;
+}
+
+/* File reading engine: paths are collected first, then read in bulk and
+ * handed to a callback as soon as each file's content is available. */
+
+typedef struct PathList {
+    char **items;
+    size_t count;
+    size_t cap;
+} PathList;
+
+typedef int (*FileReadyFn)(void *ctx, const char *path, const u8 *data, size_t len);
+
+static int path_list_push(PathList *l, const char *path) {
+    char *copy;
+
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        char **items = (char **)realloc(l->items, cap * sizeof(char *));
+        if (!items) return 0;
+        l->items = items;
+        l->cap = cap;
+    }
+
+    copy = (char *)malloc(strlen(path) + 1);
+    if (!copy) return 0;
+    strcpy(copy, path);
+    l->items[l->count++] = copy;
+    return 1;
+}
+
+static void path_list_free(PathList *l) {
+    size_t i;
+    for (i = 0; i < l->count; ++i) {
+        free(l->items[i]);
+    }
+    free(l->items);
+    memset(l, 0, sizeof(PathList));
+}
+
+static int read_file_stdio(const char *path, FileReadyFn fn, void *ctx) {
+    u8 *data = NULL;
+    size_t data_len = 0;
+    int ok;
+
+    if (!load_file(path, &data, &data_len)) {
+        omi_warn("Cannot read file %s", path);
+        return 0;
+    }
+
+    ok = fn(ctx, path, data, data_len);
+    free(data);
+    return ok;
+}
+
+static void read_files_stdio(const PathList *paths, FileReadyFn fn, void *ctx) {
+    size_t i;
+    for (i = 0; i < paths->count; ++i) {
+        read_file_stdio(paths->items[i], fn, ctx);
+    }
+}
+
+#ifdef USE_IO_URING
+/*
+ * Linux io_uring backend. Each slot owns one registered buffer and walks a
+ * file through openat+statx (issued together), one read and an async close.
+ * Files larger than a slot buffer, and any per-file failure, are handed to
+ * the stdio path so behaviour matches the portable reader.
+ */
+
+#define URING_SLOTS 64
+#define URING_BUF_SIZE 65536
+
+enum { URING_OPEN = 1, URING_STATX = 2, URING_READ = 3, URING_CLOSE = 4 };
+
+typedef struct UringSlot {
+    const char *path;
+    int pending;
+    int open_res;
+    int statx_res;
+    struct statx stx;
+    u8 *buf;
+} UringSlot;
+
+typedef struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    unsigned to_submit;
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned *sq_kmask;
+    unsigned *sq_array;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned *cq_kmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    int fixed_buffers;
+} Uring;
+
+static void uring_teardown(Uring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+}
+
+static int uring_op_supported(const struct io_uring_probe *probe, int op) {
+    return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int uring_setup(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    u8 *sq;
+    u8 *cq;
+    int ok;
+
+    memset(r, 0, sizeof(Uring));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return 0;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(0, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(0, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = (struct io_uring_sqe *)mmap(0, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED) r->sq_ptr = NULL;
+    if (r->cq_ptr == MAP_FAILED) r->cq_ptr = NULL;
+    if ((void *)r->sqes == MAP_FAILED) r->sqes = NULL;
+    if (!r->sq_ptr || !r->cq_ptr || !r->sqes) {
+        uring_teardown(r);
+        return 0;
+    }
+
+    sq = (u8 *)r->sq_ptr;
+    cq = (u8 *)r->cq_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_khead = (unsigned *)(sq + p.sq_off.head);
+    r->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_kmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_khead = (unsigned *)(cq + p.cq_off.head);
+    r->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_kmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_tail = *r->sq_ktail;
+
+    /* openat/statx/close need 5.6+; older kernels use the stdio path */
+    probe = (struct io_uring_probe *)calloc(1, probe_len);
+    ok = probe && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) >= 0
+        && uring_op_supported(probe, IORING_OP_OPENAT)
+        && uring_op_supported(probe, IORING_OP_STATX)
+        && uring_op_supported(probe, IORING_OP_READ)
+        && uring_op_supported(probe, IORING_OP_CLOSE);
+    free(probe);
+
+    if (!ok) {
+        uring_teardown(r);
+        return 0;
+    }
+    return 1;
+}
+
+static int uring_submit_and_wait(Uring *r, unsigned wait_nr) {
+    int ret;
+
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) return 0;
+    r->to_submit -= (unsigned)ret;
+    return 1;
+}
+
+/* Make room for n submission entries, submitting what is queued if the ring is full */
+static int uring_reserve(Uring *r, unsigned n) {
+    unsigned head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+
+    if (r->sq_entries - (r->sq_tail - head) >= n) return 1;
+    if (!uring_submit_and_wait(r, 0)) return 0;
+    head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+    return r->sq_entries - (r->sq_tail - head) >= n;
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *r) {
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (!uring_reserve(r, 1)) return NULL;
+
+    idx = r->sq_tail & *r->sq_kmask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    r->sq_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+static __u64 uring_tag(size_t slot, int op) {
+    return ((__u64)slot << 3) | (__u64)op;
+}
+
+static void uring_prep_path(struct io_uring_sqe *sqe, int opcode, const char *path, __u64 tag) {
+    sqe->opcode = (__u8)opcode;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (__u64)(unsigned long)path;
+    sqe->user_data = tag;
+}
+
+static int uring_start_slot(Uring *r, UringSlot *slots, size_t i, const char *path) {
+    UringSlot *s = &slots[i];
+    struct io_uring_sqe *sqe;
+
+    /* openat and statx go in together or not at all */
+    if (!uring_reserve(r, 2)) return 0;
+
+    s->path = path;
+    s->pending = 2;
+    s->open_res = -1;
+    s->statx_res = -1;
+
+    sqe = uring_get_sqe(r);
+    uring_prep_path(sqe, IORING_OP_OPENAT, path, uring_tag(i, URING_OPEN));
+    sqe->open_flags = O_RDONLY;
+
+    sqe = uring_get_sqe(r);
+    uring_prep_path(sqe, IORING_OP_STATX, path, uring_tag(i, URING_STATX));
+    sqe->len = STATX_SIZE;
+    sqe->off = (__u64)(unsigned long)&s->stx;
+    return 1;
+}
+
+/* Start the next path that gets a slot; paths the ring cannot take are read with stdio */
+static int uring_fill_slot(Uring *r, UringSlot *slots, size_t i, const PathList *paths,
+                           size_t *next, FileReadyFn fn, void *ctx) {
+    while (*next < paths->count) {
+        const char *path = paths->items[(*next)++];
+        if (uring_start_slot(r, slots, i, path)) return 1;
+        read_file_stdio(path, fn, ctx);
+    }
+    return 0;
+}
+
+static void uring_close_fd(Uring *r, int fd, size_t *closes) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    if (!sqe) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = uring_tag(0, URING_CLOSE);
+    (*closes)++;
+}
+
+static int read_files_uring(const PathList *paths, FileReadyFn fn, void *ctx) {
+    Uring r;
+    UringSlot slots[URING_SLOTS];
+    struct iovec iov[URING_SLOTS];
+    u8 *pool;
+    size_t next = 0;
+    size_t active = 0;
+    size_t closes = 0;
+    size_t i;
+
+    if (!uring_setup(&r, URING_SLOTS * 4)) return 0;
+
+    pool = (u8 *)malloc((size_t)URING_SLOTS * URING_BUF_SIZE);
+    if (!pool) {
+        uring_teardown(&r);
+        return 0;
+    }
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < URING_SLOTS; ++i) {
+        slots[i].buf = pool + i * URING_BUF_SIZE;
+        iov[i].iov_base = slots[i].buf;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+
+    /* Fixed buffers can hit RLIMIT_MEMLOCK on older kernels; plain reads still work */
+    r.fixed_buffers = syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) >= 0;
+
+    for (i = 0; i < URING_SLOTS && next < paths->count; ++i) {
+        if (!uring_fill_slot(&r, slots, i, paths, &next, fn, ctx)) break;
+        active++;
+    }
+
+    while (active > 0 || closes > 0) {
+        unsigned head;
+        unsigned tail;
+
+        if (!uring_submit_and_wait(&r, 1)) break;
+
+        head = *r.cq_khead;
+        tail = __atomic_load_n(r.cq_ktail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_kmask];
+            size_t slot = (size_t)(cqe->user_data >> 3);
+            int op = (int)(cqe->user_data & 7);
+            int res = cqe->res;
+            UringSlot *s = &slots[slot];
+            struct io_uring_sqe *sqe;
+            int done = 0;
+
+            head++;
+
+            if (op == URING_CLOSE) {
+                closes--;
+                continue;
+            }
+
+            if (op == URING_OPEN || op == URING_STATX) {
+                if (op == URING_OPEN) s->open_res = res;
+                else s->statx_res = res;
+                if (--s->pending > 0) continue;
+
+                sqe = NULL;
+                if (s->open_res >= 0 && s->statx_res >= 0
+                    && s->stx.stx_size > 0 && s->stx.stx_size <= URING_BUF_SIZE) {
+                    sqe = uring_get_sqe(&r);
+                }
+                if (sqe) {
+                    sqe->opcode = (__u8)(r.fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ);
+                    sqe->fd = s->open_res;
+                    sqe->addr = (__u64)(unsigned long)s->buf;
+                    sqe->len = (__u32)s->stx.stx_size;
+                    sqe->off = 0;
+                    sqe->buf_index = (__u16)slot;
+                    sqe->user_data = uring_tag(slot, URING_READ);
+                } else {
+                    if (s->open_res >= 0) uring_close_fd(&r, s->open_res, &closes);
+                    read_file_stdio(s->path, fn, ctx);
+                    done = 1;
+                }
+            } else if (op == URING_READ) {
+                /* Hash and stage straight out of the registered buffer */
+                if (res >= 0 && (__u64)res == s->stx.stx_size) {
+                    fn(ctx, s->path, s->buf, (size_t)res);
+                } else {
+                    read_file_stdio(s->path, fn, ctx);
+                }
+                uring_close_fd(&r, s->open_res, &closes);
+                done = 1;
+            }
+
+            if (done && !uring_fill_slot(&r, slots, slot, paths, &next, fn, ctx)) {
+                s->path = NULL;
+                active--;
+            }
+        }
+
+        __atomic_store_n(r.cq_khead, head, __ATOMIC_RELEASE);
+    }
+
+    /* A failed io_uring_enter leaves work undone; finish it the portable way */
+    for (i = 0; i < URING_SLOTS; ++i) {
+        if (slots[i].path) read_file_stdio(slots[i].path, fn, ctx);
+    }
+    while (next < paths->count) {
+        read_file_stdio(paths->items[next++], fn, ctx);
+    }
+
+    free(pool);
+    uring_teardown(&r);
+    return 1;
+}
+#endif
+
+static void read_files(const PathList *paths, FileReadyFn fn, void *ctx) {
+#ifdef USE_IO_URING
+    if (read_files_uring(paths, fn, ctx)) {
+        return;
+    }
+#endif
+    read_files_stdio(paths, fn, ctx);
+}
+
+static int has_2fa_enabled(const OmiSettings *s) {
+    FILE *f = fopen("users.txt", "r");
+    char line[MAX_LINE];
+    size_t user_len;
+
+    if (!f) return 0;
+
+    user_len = strlen(s->username);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, s->username, user_len) == 0 && line[user_len] == ':') {
+            char *p = strchr(line, ':');
+            if (!p) continue;
+            p = strchr(p + 1, ':');
+            if (p && *(p + 1) != '\n' && *(p + 1) != '\r' && *(p + 1) != '\0') {
+                fclose(f);
+                return 1;
+            }
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void prompt_otp(char *out, size_t out_len) {
+    printf("Enter OTP code (6 digits): ");
+    if (fgets(out, (int)out_len, stdin)) {
+        out[strcspn(out, "\r\n")] = '\0';
+    }
+}
+
+static const char *basename_simple(const char *path) {
+    const char *p = strrchr(path, '/');
+#if defined(_WIN32) || defined(_WIN64)
+    const char *p2 = strrchr(path, '\\');
+    if (!p || (p2 && p2 > p)) p = p2;
+#endif
+    return p ? p + 1 : path;
+}
+
+/* Copy a column's text (NULL reads as "") into out, truncated and terminated */
+static void copy_text(char *out, size_t out_len, const unsigned char *text) {
+    strncpy(out, text ? (const char *)text : "", out_len - 1);
+    out[out_len - 1] = '\0';
+}
+
+
+/* 0 = empty database, 1 = legacy hex TEXT hashes, 2 = BLOB hashes */
+static int repo_format(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int version = 0;
+    int has_blobs = 0;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (version >= OMI_FORMAT_VERSION) return version;
+
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'blobs'", -1, &stmt, 0) == SQLITE_OK) {
+        has_blobs = (sqlite3_step(stmt) == SQLITE_ROW);
+        sqlite3_finalize(stmt);
+    }
+    return has_blobs ? 1 : 0;
+}
+
+/*
+ * Concurrent writers. Adds and commits switch the repository to WAL so
+ * readers never block, and every connection retries a locked database with
+ * exponential backoff instead of failing with SQLITE_BUSY. Writers that find the repository locked stage
+ * into a journal of their own (see the repository handle below).
+ */
+
+#define OMI_BUSY_TIMEOUT_MS 30000
+#define OMI_BUSY_MAX_DELAY_MS 100
+
+/* Sleeps 1, 2, 4 ... 64 ms then 100 ms per retry, with jitter so writers that
+ * collided do not retry in lockstep; gives up after OMI_BUSY_TIMEOUT_MS. */
+static int busy_backoff(void *arg, int count) {
+    int delay = count < 7 ? 1 << count : OMI_BUSY_MAX_DELAY_MS;
+    long waited = count < 7 ? (1L << count) - 1 : 127L + (long)(count - 7) * OMI_BUSY_MAX_DELAY_MS;
+    (void)arg;
+
+    if (waited >= OMI_BUSY_TIMEOUT_MS) return 0;
+    sqlite3_sleep(delay - rand() % (delay / 2 + 1));
+    return 1;
+}
+
+static void configure_db(sqlite3 *db) {
+    sqlite3_busy_handler(db, busy_backoff, 0);
+}
+
+/* SQL function omi_unhex(hash): raw 32-byte hash of a hex TEXT or BLOB key.
+ * Every hash the C client reads goes through it, so rows written as hex by
+ * the web UI or the other clients are read like its own. */
+static void sql_unhex(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    u8 hash[OMI_HASH_LEN];
+    const char *hex;
+    (void)argc;
+
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    hex = (const char *)sqlite3_value_text(argv[0]);
+    if (!hex_to_hash(hex, (size_t)sqlite3_value_bytes(argv[0]), hash)) {
+        sqlite3_result_error(ctx, "invalid hex hash in repository", -1);
+        return;
+    }
+    sqlite3_result_blob(ctx, hash, OMI_HASH_LEN, SQLITE_TRANSIENT);
+}
+
+/* SQL function omi_key(raw hash): the key as this repository stores it,
+ * hex TEXT in format 1 and the BLOB itself in format 2 */
+static void sql_key(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    char hex[OMI_HASH_LEN * 2 + 1];
+    (void)argc;
+
+    if (sqlite3_user_data(ctx) || sqlite3_value_bytes(argv[0]) != OMI_HASH_LEN) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    omi_hash_hex((const u8 *)sqlite3_value_blob(argv[0]), hex, sizeof(hex));
+    sqlite3_result_text(ctx, hex, OMI_HASH_LEN * 2, SQLITE_TRANSIENT);
+}
+
+static int open_db(const char *db_name, sqlite3 **out_db) {
+    sqlite3 *db;
+    int format;
+
+    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
+        omi_warn("Unable to open database %s", db_name);
+        sqlite3_close(db);
+        return 0;
+    }
+    configure_db(db);
+
+    format = repo_format(db);
+    if (format > OMI_FORMAT_VERSION) {
+        omi_warn("%s uses repository format %d, this omi supports %d", db_name, format, OMI_FORMAT_VERSION);
+        sqlite3_close(db);
+        return 0;
+    }
+    sqlite3_create_function(db, "omi_unhex", 1, SQLITE_UTF8, 0, sql_unhex, 0, 0);
+    sqlite3_create_function(db, "omi_key", 1, SQLITE_UTF8, format >= 2 ? (void *)db : NULL, sql_key, 0, 0);
+
+    *out_db = db;
+    return 1;
+}
+
+/* Tables and indexes shared by both formats, after blobs, files, staging */
+#define OMI_COMMON_SCHEMA_SQL \
+    "CREATE TABLE IF NOT EXISTS commits (id INTEGER PRIMARY KEY AUTOINCREMENT, message TEXT, datetime TEXT, user TEXT);" \
+    "CREATE INDEX IF NOT EXISTS idx_files_hash ON files(hash);" \
+    "CREATE INDEX IF NOT EXISTS idx_files_commit ON files(commit_id);" \
+    "CREATE INDEX IF NOT EXISTS idx_files_filename ON files(filename);" \
+    OMI_DELTAS_SQL ";" \
+    OMI_JOURNALS_SQL ";"
+
+/* Format 1 is what the web UI and the other clients read and write */
+#define OMI_SCHEMA_HEX_SQL \
+    "CREATE TABLE IF NOT EXISTS blobs (hash TEXT PRIMARY KEY, data BLOB, size INTEGER);" \
+    "CREATE TABLE IF NOT EXISTS files (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash TEXT, datetime TEXT, commit_id INTEGER);" \
+    "CREATE TABLE IF NOT EXISTS staging (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash TEXT, datetime TEXT);" \
+    OMI_COMMON_SCHEMA_SQL
+
+/* Format 2, for both omi init --format=2 and omi migrate */
+#define OMI_SCHEMA_BLOB_SQL \
+    "CREATE TABLE IF NOT EXISTS blobs (hash BLOB PRIMARY KEY, data BLOB, size INTEGER) WITHOUT ROWID;" \
+    "CREATE TABLE IF NOT EXISTS files (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash BLOB, datetime TEXT, commit_id INTEGER);" \
+    "CREATE TABLE IF NOT EXISTS staging (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash BLOB, datetime TEXT);" \
+    OMI_COMMON_SCHEMA_SQL \
+    "PRAGMA user_version = 2;"
+
+int omi_init(const char *db_name) {
+    return omi_init_format(db_name, 1);
+}
+
+int omi_init_format(const char *db_name, int format) {
+    sqlite3 *db;
+    char *err = NULL;
+    int existing;
+
+    if (format != 1 && format != OMI_FORMAT_VERSION) {
+        omi_warn("Unknown repository format %d", format);
+        return 0;
+    }
+    if (!open_db(db_name, &db)) {
+        return 0;
+    }
+
+    /* Re-running init never changes the format of an existing repository */
+    existing = repo_format(db);
+    if (existing != 0) format = existing;
+
+    if (sqlite3_exec(db, format == 1 ? OMI_SCHEMA_HEX_SQL : OMI_SCHEMA_BLOB_SQL, 0, 0, &err) != SQLITE_OK) {
+        omi_warn("%s", err);
+        sqlite3_free(err);
+        sqlite3_close(db);
+        return 0;
+    }
+
+    sqlite3_close(db);
+    return 1;
+}
+
+static long db_size_bytes(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    long pages = 0;
+    long page_size = 0;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA page_count", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            pages = (long)sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            page_size = (long)sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return pages * page_size;
+}
+
+int omi_migrate(const char *db_name) {
+    sqlite3 *db;
+    char *err = NULL;
+    long before;
+    long after;
+    int format;
+    /* The format 1 tables are set aside and copied into the schema omi init
+     * --format=2 creates. Their indexes are dropped first, as they would keep
+     * their names. Staging from the web UI has no id column. */
+    const char *sql =
+        "BEGIN IMMEDIATE;"
+        "DROP INDEX IF EXISTS idx_blobs_hash;"
+        "DROP INDEX IF EXISTS idx_blobs_size;"
+        "DROP INDEX IF EXISTS idx_files_hash;"
+        "DROP INDEX IF EXISTS idx_files_commit;"
+        "DROP INDEX IF EXISTS idx_files_filename;"
+        "ALTER TABLE blobs RENAME TO blobs_v1;"
+        "ALTER TABLE files RENAME TO files_v1;"
+        "ALTER TABLE staging RENAME TO staging_v1;"
+        OMI_SCHEMA_BLOB_SQL
+        "INSERT OR IGNORE INTO blobs (hash, data, size) SELECT omi_unhex(hash), data, size FROM blobs_v1;"
+        "INSERT INTO files (id, filename, hash, datetime, commit_id) SELECT id, filename, omi_unhex(hash), datetime, commit_id FROM files_v1;"
+        "INSERT INTO staging (filename, hash, datetime) SELECT filename, omi_unhex(hash), datetime FROM staging_v1 ORDER BY rowid;"
+        "DROP TABLE blobs_v1;"
+        "DROP TABLE files_v1;"
+        "DROP TABLE staging_v1;"
+        "COMMIT;";
+    /* Hex rows the web UI or other clients added to a format 2 repository */
+    const char *normalize_sql =
+        "BEGIN IMMEDIATE;"
+        "INSERT OR IGNORE INTO blobs (hash, data, size) SELECT omi_unhex(hash), data, size FROM blobs WHERE typeof(hash) = 'text';"
+        "DELETE FROM blobs WHERE typeof(hash) = 'text';"
+        "UPDATE files SET hash = omi_unhex(hash) WHERE typeof(hash) = 'text';"
+        "UPDATE staging SET hash = omi_unhex(hash) WHERE typeof(hash) = 'text';"
+        "DROP INDEX IF EXISTS idx_blobs_size;"
+        "COMMIT;";
+
+    if (!file_exists(db_name)) {
+        omi_warn("Database file %s not found", db_name);
+        return 0;
+    }
+
+    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
+        omi_warn("Unable to open database %s", db_name);
+        sqlite3_close(db);
+        return 0;
+    }
+
+    sqlite3_busy_handler(db, busy_backoff, 0);
+    format = repo_format(db);
+    sqlite3_create_function(db, "omi_unhex", 1, SQLITE_UTF8, 0, sql_unhex, 0, 0);
+    if (format == OMI_FORMAT_VERSION) {
+        if (sqlite3_exec(db, normalize_sql, 0, 0, &err) != SQLITE_OK) {
+            omi_warn("Migration failed: %s", err);
+            sqlite3_free(err);
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+            sqlite3_close(db);
+            return 0;
+        }
+        omi_info("Repository already uses format %d; hex rows from other clients converted\n", format);
+        sqlite3_close(db);
+        return 1;
+    }
+    if (format != 1) {
+        if (format == 0) omi_warn("%s is not an omi repository", db_name);
+        else omi_warn("%s uses repository format %d, this omi supports %d", db_name, format, OMI_FORMAT_VERSION);
+        sqlite3_close(db);
+        return 0;
+    }
+
+    before = db_size_bytes(db);
+
+    if (sqlite3_exec(db, sql, 0, 0, &err) != SQLITE_OK) {
+        omi_warn("Migration failed: %s", err);
+        sqlite3_free(err);
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        sqlite3_close(db);
+        return 0;
+    }
+
+    /* Rebuild pages so the smaller keys actually shrink the file */
+    sqlite3_exec(db, "VACUUM", 0, 0, 0);
+    after = db_size_bytes(db);
+    sqlite3_close(db);
+
+    omi_info("Migrated %s to format %d (%ld -> %ld bytes)\n", db_name, OMI_FORMAT_VERSION, before, after);
+    return 1;
+}
+
+static int use_internal_http(const OmiSettings *s) {
+#ifdef USE_LIBCURL
+    if (s->use_internal_http) {
+        return 1;
+    }
+#else
+    (void)s;
+#endif
+    return 0;
+}
+
+/*
+ * Authenticated HTTP session. The password (and OTP) is sent once to obtain
+ * a short-lived API token, which is cached in .omi_token and reused by every
+ * push/pull until it expires. With libcurl one easy handle is kept for the
+ * whole session so the TCP/TLS connection is reused between requests.
+ * Servers without token support get the old per-request credentials.
+ *
+ * Downloads ask for a compressed body with Accept-Encoding and libcurl
+ * decodes it while writing, so old servers simply send the file as is.
+ * Uploads are gzipped on the fly only if the server listed gzip in an
+ * Accept-Encoding response header (RFC 7694) when it issued the token.
+ */
+
+#define OMI_TOKEN_FILE ".omi_token"
+#define OMI_TOKEN_MARGIN 30
+/* How long a "no token support" answer is trusted before asking again */
+#define OMI_LEGACY_RECHECK 86400
+
+#ifdef OMI_WINDOWS
+#define popen _popen
+#define pclose _pclose
+#endif
+
+typedef struct HttpSession {
+    const OmiSettings *s;
+    char token[MAX_SMALL];
+    long expires;
+    char otp_code[32];
+    int otp_prompted;
+    int legacy;
+    int upload_gzip;
+    /* HTTP status of the last request, 0 if it never reached the server */
+    int http_status;
+    /* Bytes sent or received by the last transfer, 0 if unknown */
+    double wire_bytes;
+#ifdef USE_LIBCURL
+    CURL *curl;
+#endif
+} HttpSession;
+
+typedef struct MemBuf {
+    char data[MAX_LINE];
+    size_t len;
+} MemBuf;
+
+static int json_string_field(const char *body, const char *key, char *out, size_t out_len) {
+    char pattern[MAX_SMALL];
+    const char *p;
+    size_t n = 0;
+
+    sprintf(pattern, "\"%.100s\"", key);
+    p = strstr(body, pattern);
+    if (!p) return 0;
+    p = strchr(p + strlen(pattern), '"');
+    if (!p) return 0;
+    p++;
+
+    while (*p && *p != '"' && n + 1 < out_len) {
+        out[n++] = *p++;
+    }
+    out[n] = '\0';
+    return (*p == '"' && n > 0);
+}
+
+static long json_long_field(const char *body, const char *key) {
+    char pattern[MAX_SMALL];
+    const char *p;
+
+    sprintf(pattern, "\"%.100s\"", key);
+    p = strstr(body, pattern);
+    if (!p) return 0;
+    p = strchr(p + strlen(pattern), ':');
+    return p ? atol(p + 1) : 0;
+}
+
+static void token_cache_clear(HttpSession *hs) {
+    hs->token[0] = '\0';
+    hs->expires = 0;
+    remove(OMI_TOKEN_FILE);
+}
+
+static int token_cache_load(HttpSession *hs) {
+    FILE *f = fopen(OMI_TOKEN_FILE, "r");
+    char line[MAX_LINE];
+    char user[MAX_SMALL] = "";
+    char server[MAX_PATH_LEN] = "";
+    int legacy = 0;
+
+    if (!f) return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "TOKEN=", 6) == 0) {
+            strncpy(hs->token, line + 6, sizeof(hs->token) - 1);
+            hs->token[sizeof(hs->token) - 1] = '\0';
+        } else if (strcmp(line, "LEGACY=1") == 0) {
+            legacy = 1;
+        } else if (strncmp(line, "EXPIRES=", 8) == 0) {
+            hs->expires = atol(line + 8);
+        } else if (strncmp(line, "USERNAME=", 9) == 0) {
+            strncpy(user, line + 9, sizeof(user) - 1);
+            user[sizeof(user) - 1] = '\0';
+        } else if (strncmp(line, "REPOS=", 6) == 0) {
+            strncpy(server, line + 6, sizeof(server) - 1);
+            server[sizeof(server) - 1] = '\0';
+        } else if (strcmp(line, "UPLOAD_ENCODING=gzip") == 0) {
+            hs->upload_gzip = 1;
+        }
+    }
+    fclose(f);
+
+    /* A token is only good for the account and server it was issued by */
+    if ((!hs->token[0] && !legacy) || strcmp(user, hs->s->username) != 0 || strcmp(server, hs->s->repos) != 0
+        || hs->expires <= (long)time(NULL) + OMI_TOKEN_MARGIN) {
+        hs->token[0] = '\0';
+        hs->expires = 0;
+        return 0;
+    }
+    if (legacy) {
+        hs->token[0] = '\0';
+        hs->legacy = 1;
+    }
+    return 1;
+}
+
+static void token_cache_save(const HttpSession *hs) {
+    FILE *f;
+
+    remove(OMI_TOKEN_FILE);
+#if defined(OMI_POSIX) && !defined(OMI_AMIGA)
+    /* Created owner-only, so the token is never readable by others */
+    {
+        int fd = open(OMI_TOKEN_FILE, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+
+        if (fd < 0) return;
+        f = fdopen(fd, "w");
+        if (!f) {
+            close(fd);
+            return;
+        }
+    }
+#else
+    f = fopen(OMI_TOKEN_FILE, "w");
+    if (!f) return;
+#endif
+    if (hs->legacy) {
+        fprintf(f, "LEGACY=1\n");
+    } else {
+        fprintf(f, "TOKEN=%s\n", hs->token);
+    }
+    fprintf(f, "EXPIRES=%ld\nUSERNAME=%s\nREPOS=%s\n", hs->expires, hs->s->username, hs->s->repos);
+    if (hs->upload_gzip) fprintf(f, "UPLOAD_ENCODING=gzip\n");
+    fclose(f);
+}
+
+static void session_prompt_otp(HttpSession *hs) {
+    if (hs->otp_prompted) return;
+    hs->otp_prompted = 1;
+    if (has_2fa_enabled(hs->s)) {
+        prompt_otp(hs->otp_code, sizeof(hs->otp_code));
+    }
+}
+
+/* Rejected credentials or token: the only failures worth a new token */
+static int session_auth_rejected(const HttpSession *hs) {
+    return hs->http_status == 401 || hs->http_status == 403;
+}
+
+/* Appends the curl config line: option = "key=value", value quoted */
+static void curl_config_add(char *out, size_t out_len, const char *option, const char *key, const char *value) {
+    size_t n = strlen(out);
+
+    if (n + strlen(option) + strlen(key) + 8 >= out_len) return;
+    n += sprintf(out + n, "%s = \"%s=", option, key);
+    while (*value && n + 5 < out_len) {
+        if (*value == '"' || *value == '\\') out[n++] = '\\';
+        out[n++] = *value++;
+    }
+    out[n++] = '"';
+    out[n++] = '\n';
+    out[n] = '\0';
+}
+
+/* Status code of the last response in a curl -D header dump */
+static int curl_header_status(const char *path) {
+    FILE *f = fopen(path, "rb");
+    char line[MAX_SMALL];
+    int status = 0;
+
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        const char *sp = strchr(line, ' ');
+        if (strncmp(line, "HTTP/", 5) == 0 && sp) status = atoi(sp + 1);
+    }
+    fclose(f);
+    return status;
+}
+
+/*
+ * Runs the external curl with its credentials in a config read from stdin
+ * (-K -), so the password never appears on a command line other users can
+ * see. The response headers go to <base>.hdr for the HTTP status.
+ */
+static int curl_exec_run(HttpSession *hs, const char *args, const char *config, const char *base) {
+    char cmd[2048];
+    char hdr[MAX_PATH_LEN];
+    FILE *p;
+    int ok;
+
+    snprintf(hdr, sizeof(hdr), "%s.hdr", base);
+    snprintf(cmd, sizeof(cmd), "%s -K - -D \"%s\" %s", hs->s->curl, hdr, args);
+    p = popen(cmd, "w");
+    if (!p) return 0;
+    fputs(config, p);
+    ok = (pclose(p) == 0);
+    hs->http_status = curl_header_status(hdr);
+    remove(hdr);
+    return ok;
+}
+
+/* Downloads land in <path>.part and only replace path once complete */
+static int download_finish(const char *part, const char *path, int ok) {
+    if (ok) {
+        remove(path);
+        ok = (rename(part, path) == 0);
+    }
+    if (!ok) remove(part);
+    return ok;
+}
+
+#ifdef USE_LIBCURL
+static size_t write_file_cb(void *ptr, size_t size, size_t nmemb, void *stream) {
+    FILE *f = (FILE *)stream;
+    return fwrite(ptr, size, nmemb, f);
+}
+
+static size_t write_mem_cb(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    MemBuf *buf = (MemBuf *)userdata;
+    size_t n = size * nmemb;
+    size_t room = sizeof(buf->data) - 1 - buf->len;
+
+    memcpy(buf->data + buf->len, ptr, n < room ? n : room);
+    buf->len += (n < room ? n : room);
+    buf->data[buf->len] = '\0';
+    return n;
+}
+
+/* Response header "Accept-Encoding: ..., gzip": the server takes gzip uploads */
+static size_t accept_encoding_cb(char *line, size_t size, size_t nitems, void *userdata) {
+    HttpSession *hs = (HttpSession *)userdata;
+    const char *name = "accept-encoding:";
+    size_t n = size * nitems;
+    size_t i;
+
+    for (i = 0; name[i] && i < n; ++i) {
+        char c = line[i];
+        if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        if (c != name[i]) return n;
+    }
+    for (; i + 4 <= n; ++i) {
+        if (memcmp(line + i, "gzip", 4) == 0) hs->upload_gzip = 1;
+    }
+    return n;
+}
+
+static void session_http_status(HttpSession *hs, CURL *curl) {
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    hs->http_status = (int)code;
+}
+
+static CURL *session_curl(HttpSession *hs) {
+    if (!hs->curl) {
+        hs->curl = curl_easy_init();
+    } else {
+        /* Drops per-request options, keeps the live connection */
+        curl_easy_reset(hs->curl);
+    }
+    return hs->curl;
+}
+#endif
+
+static int request_token_libcurl(HttpSession *hs, MemBuf *body) {
+#ifdef USE_LIBCURL
+    const OmiSettings *s = hs->s;
+    CURL *curl = session_curl(hs);
+    CURLcode res;
+    char url[MAX_PATH_LEN];
+    char *user;
+    char *pass;
+    char post_fields[MAX_LINE];
+
+    if (!curl) return 0;
+
+    user = curl_easy_escape(curl, s->username, 0);
+    pass = curl_easy_escape(curl, s->password, 0);
+    snprintf(url, sizeof(url), "%s/", s->repos);
+    snprintf(post_fields, sizeof(post_fields), "username=%s&password=%s&action=token%s%s",
+        user ? user : "", pass ? pass : "",
+        hs->otp_code[0] ? "&otp_code=" : "", hs->otp_code);
+    curl_free(user);
+    curl_free(pass);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)s->http_timeout);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_mem_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, body);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, accept_encoding_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, hs);
+
+    hs->upload_gzip = 0;
+    res = curl_easy_perform(curl);
+    memset(post_fields, 0, sizeof(post_fields));
+    session_http_status(hs, curl);
+    return (res == CURLE_OK);
+#else
+    (void)hs;
+    (void)body;
+    return 0;
+#endif
+}
+
+static int request_token_curl_exec(HttpSession *hs, MemBuf *body) {
+    const OmiSettings *s = hs->s;
+    const char *tmp = OMI_TOKEN_FILE ".tmp";
+    char args[MAX_LINE];
+    char config[MAX_LINE] = "";
+    FILE *f;
+    int ok;
+
+    curl_config_add(config, sizeof(config), "data-urlencode", "username", s->username);
+    curl_config_add(config, sizeof(config), "data-urlencode", "password", s->password);
+    if (hs->otp_code[0]) {
+        curl_config_add(config, sizeof(config), "data-urlencode", "otp_code", hs->otp_code);
+    }
+
+    snprintf(args, sizeof(args), "-s -f -X POST -d \"action=token\" -o \"%s\" \"%s/\"", tmp, s->repos);
+    ok = curl_exec_run(hs, args, config, tmp);
+    memset(config, 0, sizeof(config));
+
+    f = fopen(tmp, "rb");
+    if (f) {
+        body->len = fread(body->data, 1, sizeof(body->data) - 1, f);
+        body->data[body->len] = '\0';
+        fclose(f);
+        remove(tmp);
+    }
+    return ok && body->len > 0;
+}
+
+static int session_fetch_token(HttpSession *hs) {
+    MemBuf body;
+    int ok;
+
+    memset(&body, 0, sizeof(body));
+    session_prompt_otp(hs);
+
+    if (use_internal_http(hs->s)) {
+        ok = request_token_libcurl(hs, &body);
+    } else {
+        ok = request_token_curl_exec(hs, &body);
+    }
+
+    if (!ok || !json_string_field(body.data, "token", hs->token, sizeof(hs->token))) {
+        hs->token[0] = '\0';
+        return 0;
+    }
+
+    hs->expires = json_long_field(body.data, "expires");
+    if (hs->expires <= 0) {
+        hs->expires = (long)time(NULL) + 300;
+    }
+    token_cache_save(hs);
+    return 1;
+}
+
+static void http_session_begin(HttpSession *hs, const OmiSettings *s) {
+    memset(hs, 0, sizeof(HttpSession));
+    hs->s = s;
+
+    if (token_cache_load(hs)) {
+        if (hs->legacy) session_prompt_otp(hs);
+        return;
+    }
+
+    if (!session_fetch_token(hs)) {
+        /* Older server: fall back to sending credentials with every request */
+        hs->legacy = 1;
+        /* Remember a server that answered without a token, not a network
+         * failure, a wrong password or a rate limit */
+        if (hs->http_status == 200 || hs->http_status == 400 || hs->http_status == 404) {
+            hs->expires = (long)time(NULL) + OMI_LEGACY_RECHECK;
+            token_cache_save(hs);
+        }
+    }
+}
+
+static void http_session_end(HttpSession *hs) {
+#ifdef USE_LIBCURL
+    if (hs->curl) curl_easy_cleanup(hs->curl);
+#endif
+    memset(hs, 0, sizeof(HttpSession));
+}
+
+/* One upload or download: repo_name is the repository on the server, path
+ * the local file sent or written, fields extra "&key=value" POST pairs
+ * (already URL-encoded) for downloads. */
+typedef struct Transfer {
+    const char *repo_name;
+    const char *path;
+    const char *action;
+    const char *fields;
+} Transfer;
+
+#ifdef OMI_GZIP_UPLOAD
+/* Level 1: on a WAN link the wire is the bottleneck, not the CPU, and the
+ * fastest level already removes most of SQLite's empty and repeated pages */
+#define OMI_GZIP_LEVEL 1
+
+/* Deflates a file as libcurl asks for the next piece of the request body */
+typedef struct GzipReader {
+    FILE *f;
+    z_stream z;
+    int flush;
+    int done;
+    unsigned char in[65536];
+} GzipReader;
+
+static int gzip_reader_open(GzipReader *gz, const char *path) {
+    memset(gz, 0, sizeof(GzipReader));
+    gz->f = fopen(path, "rb");
+    if (!gz->f) return 0;
+    /* 15 + 16: gzip header and trailer instead of a raw zlib stream */
+    if (deflateInit2(&gz->z, OMI_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fclose(gz->f);
+        return 0;
+    }
+    gz->flush = Z_NO_FLUSH;
+    return 1;
+}
+
+static void gzip_reader_close(GzipReader *gz) {
+    deflateEnd(&gz->z);
+    fclose(gz->f);
+}
+
+static size_t gzip_read_cb(char *buffer, size_t size, size_t nitems, void *userdata) {
+    GzipReader *gz = (GzipReader *)userdata;
+
+    if (gz->done) return 0;
+    gz->z.next_out = (Bytef *)buffer;
+    gz->z.avail_out = (uInt)(size * nitems);
+
+    while (gz->z.avail_out > 0) {
+        int rc;
+        if (gz->z.avail_in == 0 && gz->flush == Z_NO_FLUSH) {
+            size_t n = fread(gz->in, 1, sizeof(gz->in), gz->f);
+            if (ferror(gz->f)) return CURL_READFUNC_ABORT;
+            if (n < sizeof(gz->in)) gz->flush = Z_FINISH;
+            gz->z.next_in = gz->in;
+            gz->z.avail_in = (uInt)n;
+        }
+        rc = deflate(&gz->z, gz->flush);
+        if (rc == Z_STREAM_END) {
+            gz->done = 1;
+            break;
+        }
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return CURL_READFUNC_ABORT;
+    }
+    return size * nitems - gz->z.avail_out;
+}
+#endif
+
+static int push_with_libcurl(HttpSession *hs, const Transfer *t) {
+#ifdef USE_LIBCURL
+    const OmiSettings *s = hs->s;
+    CURL *curl = session_curl(hs);
+    CURLcode res;
+    struct curl_httppost *form = NULL;
+    struct curl_httppost *last = NULL;
+    char url[MAX_PATH_LEN];
+#ifdef OMI_GZIP_UPLOAD
+    struct curl_slist *headers = NULL;
+    GzipReader gz;
+    int gzip = 0;
+#endif
+
+    if (!curl) return 0;
+#ifdef OMI_GZIP_UPLOAD
+    if (hs->upload_gzip && s->compression) {
+        gzip = gzip_reader_open(&gz, t->path);
+    }
+#endif
+
+    snprintf(url, sizeof(url), "%s/", s->repos);
+
+    if (hs->legacy) {
+        curl_formadd(&form, &last, CURLFORM_COPYNAME, "username", CURLFORM_COPYCONTENTS, s->username, CURLFORM_END);
+        curl_formadd(&form, &last, CURLFORM_COPYNAME, "password", CURLFORM_COPYCONTENTS, s->password, CURLFORM_END);
+        if (hs->otp_code[0]) {
+            curl_formadd(&form, &last, CURLFORM_COPYNAME, "otp_code", CURLFORM_COPYCONTENTS, hs->otp_code, CURLFORM_END);
+        }
+    } else {
+        curl_formadd(&form, &last, CURLFORM_COPYNAME, "token", CURLFORM_COPYCONTENTS, hs->token, CURLFORM_END);
+    }
+    curl_formadd(&form, &last, CURLFORM_COPYNAME, "repo_name", CURLFORM_COPYCONTENTS, t->repo_name, CURLFORM_END);
+#ifdef OMI_GZIP_UPLOAD
+    /* Length unknown until the end: the body goes out chunked */
+    if (gzip) {
+        curl_formadd(&form, &last, CURLFORM_COPYNAME, "repo_encoding", CURLFORM_COPYCONTENTS, "gzip", CURLFORM_END);
+        curl_formadd(&form, &last, CURLFORM_COPYNAME, "repo_file", CURLFORM_STREAM, &gz,
+            CURLFORM_FILENAME, t->repo_name, CURLFORM_CONTENTTYPE, "application/gzip", CURLFORM_END);
+        headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, gzip_read_cb);
+    } else
+#endif
+    curl_formadd(&form, &last, CURLFORM_COPYNAME, "repo_file", CURLFORM_FILE, t->path, CURLFORM_END);
+    curl_formadd(&form, &last, CURLFORM_COPYNAME, "action", CURLFORM_COPYCONTENTS, t->action, CURLFORM_END);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPPOST, form);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)s->http_timeout);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD, &hs->wire_bytes);
+    session_http_status(hs, curl);
+    curl_formfree(form);
+#ifdef OMI_GZIP_UPLOAD
+    curl_slist_free_all(headers);
+    if (gzip) gzip_reader_close(&gz);
+#endif
+
+    if (res == CURLE_HTTP_RETURNED_ERROR) return -1;
+    return (res == CURLE_OK);
+#else
+    (void)hs;
+    (void)t;
+    return 0;
+#endif
+}
+
+static int download_with_libcurl(HttpSession *hs, const Transfer *t) {
+#ifdef USE_LIBCURL
+    const OmiSettings *s = hs->s;
+    CURL *curl = session_curl(hs);
+    CURLcode res;
+    FILE *f = NULL;
+    char url[MAX_PATH_LEN];
+    char part[MAX_PATH_LEN];
+    char *post_fields;
+    size_t fields_len = strlen(t->fields) + MAX_LINE;
+
+    if (!curl) return 0;
+
+    snprintf(url, sizeof(url), "%s/", s->repos);
+
+    post_fields = (char *)malloc(fields_len);
+    if (!post_fields) return 0;
+
+    if (hs->legacy) {
+        snprintf(post_fields, fields_len,
+            "username=%s&password=%s&repo_name=%s&action=%s%s%s%s",
+            s->username, s->password, t->repo_name, t->action,
+            hs->otp_code[0] ? "&otp_code=" : "", hs->otp_code, t->fields);
+    } else {
+        snprintf(post_fields, fields_len,
+            "token=%s&repo_name=%s&action=%s%s", hs->token, t->repo_name, t->action, t->fields);
+    }
+
+    snprintf(part, sizeof(part), "%s.part", t->path);
+    f = fopen(part, "wb");
+    if (!f) {
+        free(post_fields);
+        return 0;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)s->http_timeout);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+    if (s->compression) {
+        /* "": every coding this libcurl decodes (gzip, deflate, br, zstd) */
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    }
+
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &hs->wire_bytes);
+    session_http_status(hs, curl);
+    if (fclose(f) != 0 && res == CURLE_OK) res = CURLE_WRITE_ERROR;
+    free(post_fields);
+
+    if (!download_finish(part, t->path, res == CURLE_OK) && res == CURLE_OK) return 0;
+    if (res == CURLE_HTTP_RETURNED_ERROR) return -1;
+    return (res == CURLE_OK);
+#else
+    (void)hs;
+    (void)t;
+    return 0;
+#endif
+}
+
+/* Credentials as curl config lines: the token, or legacy user/password */
+static void curl_exec_auth(const HttpSession *hs, const char *option, char *out, size_t out_len) {
+    out[0] = '\0';
+    if (!hs->legacy) {
+        curl_config_add(out, out_len, option, "token", hs->token);
+        return;
+    }
+
+    curl_config_add(out, out_len, option, "username", hs->s->username);
+    curl_config_add(out, out_len, option, "password", hs->s->password);
+    if (hs->otp_code[0]) {
+        curl_config_add(out, out_len, option, "otp_code", hs->otp_code);
+    }
+}
+
+static int push_with_curl_exec(HttpSession *hs, const Transfer *t) {
+    char args[2048];
+    char auth[MAX_LINE];
+    int ok;
+
+    curl_exec_auth(hs, "form-string", auth, sizeof(auth));
+    snprintf(args, sizeof(args),
+        "-f -X POST -F \"repo_name=%s\" -F \"repo_file=@%s\" -F \"action=%s\" \"%s/\"",
+        t->repo_name, t->path, t->action, hs->s->repos);
+
+    ok = curl_exec_run(hs, args, auth, t->path);
+    memset(auth, 0, sizeof(auth));
+    return ok;
+}
+
+static int download_with_curl_exec(HttpSession *hs, const Transfer *t) {
+    char args[2048];
+    char auth[MAX_LINE];
+    char part[MAX_PATH_LEN];
+    char fields_file[MAX_PATH_LEN] = "";
+    char fields_part[MAX_PATH_LEN + 16] = "";
+    int ok;
+
+    /* Extra fields can be long (blob hash lists): pass them through a file */
+    if (t->fields[0]) {
+        FILE *f;
+        snprintf(fields_file, sizeof(fields_file), "%s.fields", t->path);
+        f = fopen(fields_file, "wb");
+        if (!f) return 0;
+        fputs(t->fields + 1, f);
+        fclose(f);
+        snprintf(fields_part, sizeof(fields_part), " -d \"@%s\"", fields_file);
+    }
+
+    curl_exec_auth(hs, "data-urlencode", auth, sizeof(auth));
+    snprintf(part, sizeof(part), "%s.part", t->path);
+    snprintf(args, sizeof(args),
+        "-f%s -X POST -d \"repo_name=%s\" -d \"action=%s\"%s -o \"%s\" \"%s/\"",
+        hs->s->compression ? " --compressed" : "", t->repo_name, t->action,
+        fields_part, part, hs->s->repos);
+
+    ok = curl_exec_run(hs, args, auth, t->path);
+    memset(auth, 0, sizeof(auth));
+    if (fields_file[0]) remove(fields_file);
+    return download_finish(part, t->path, ok);
+}
+
+/* Transfers return 1 on success, 0 on a transport failure and -1 when the
+ * server answered with an HTTP error (only libcurl can tell the two apart). */
+typedef int (*TransferFn)(HttpSession *hs, const Transfer *t);
+
+static int session_transfer(HttpSession *hs, const Transfer *t, TransferFn internal, TransferFn external) {
+    int attempt;
+    int res;
+
+    for (attempt = 0; attempt < 2; ++attempt) {
+        res = 0;
+        hs->wire_bytes = 0;
+        hs->http_status = 0;
+        if (use_internal_http(hs->s)) {
+            res = internal(hs, t);
+            if (res > 0) return 1;
+            if (res == 0) omi_info("Internal HTTP failed, falling back to curl\n");
+        }
+        if (res == 0 && external(hs, t)) return 1;
+
+        /* The server may have revoked or expired the token early: renew once,
+         * but only when it said so, not after a network or server error */
+        if (hs->legacy || attempt > 0 || !session_auth_rejected(hs)) break;
+        token_cache_clear(hs);
+        hs->otp_prompted = 0;
+        hs->otp_code[0] = '\0';
+        if (!session_fetch_token(hs)) break;
+    }
+    return 0;
+}
+
+/* Rows in an optional table; 0 when the table does not exist */
+static long count_rows(const char *db_name, const char *table) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    long count = 0;
+    char sql[MAX_SMALL];
+
+    if (sqlite3_open_v2(db_name, &db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+        sqlite3_close(db);
+        return 0;
+    }
+    sqlite3_busy_handler(db, busy_backoff, 0);
+
+    sprintf(sql, "SELECT COUNT(*) FROM %.64s", table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            count = (long)sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+    return count;
+}
+
+
+static void url_encode(const char *in, char *out, size_t out_len) {
+    const char *hex = "0123456789ABCDEF";
+    size_t n = 0;
+
+    for (; *in && n + 4 < out_len; ++in) {
+        unsigned char c = (unsigned char)*in;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '-' || c == '_' || c == '.' || c == '/' || c == '*' || c == '?') {
+            out[n++] = (char)c;
+        } else {
+            out[n++] = '%';
+            out[n++] = hex[c >> 4];
+            out[n++] = hex[c & 0x0f];
+        }
+    }
+    out[n] = '\0';
+}
+
+/* Compare the repository file with what crossed the network for it */
+static void report_wire_bytes(const HttpSession *hs, const char *path) {
+    FILE *f;
+    long size;
+
+    if (hs->wire_bytes <= 0) return;
+    f = fopen(path, "rb");
+    if (!f) return;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    if (size > 0) {
+        omi_info("  %ld bytes, %.0f on the wire (%.0f%%)\n", size, hs->wire_bytes, 100.0 * hs->wire_bytes / size);
+    }
+}
+
+/* Fold the WAL back into the database file before it is uploaded or replaced */
+static void checkpoint_db(const char *db_name) {
+    sqlite3 *db;
+
+    if (!file_exists(db_name)) return;
+    if (sqlite3_open_v2(db_name, &db, SQLITE_OPEN_READWRITE, 0) == SQLITE_OK) {
+        sqlite3_busy_handler(db, busy_backoff, 0);
+        sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE)", 0, 0, 0);
+    }
+    sqlite3_close(db);
+}
+
+/* Defined with the delta store, after the repository handle */
+static int write_push_copy(const char *db_name, const OmiSettings *s, const char *copy_path);
+
+int omi_push(const OmiSettings *s, const char **db_names, int count) {
+    HttpSession hs;
+    int ok = 1;
+    int i;
+
+    if (strcmp(s->api_enabled, "0") == 0) {
+        omi_warn("API is disabled");
+        return 0;
+    }
+
+    for (i = 0; i < count; ++i) {
+        long promised;
+        if (!file_exists(db_names[i])) {
+            omi_warn("Database file %s not found", db_names[i]);
+            return 0;
+        }
+        /* Pushing a partial clone would replace server blobs with nothing */
+        promised = count_rows(db_names[i], "promised");
+        if (promised > 0) {
+            omi_warn("%s is a partial clone with %ld blobs not fetched. Run 'omi fetch' first.", db_names[i], promised);
+            return 0;
+        }
+        checkpoint_db(db_names[i]);
+    }
+
+    http_session_begin(&hs, s);
+    for (i = 0; i < count; ++i) {
+        Transfer t;
+        char push_copy[MAX_PATH_LEN];
+
+        snprintf(push_copy, sizeof(push_copy), "%s-push", db_names[i]);
+        if (!write_push_copy(db_names[i], s, push_copy)) {
+            omi_warn("Cannot prepare %s for upload", db_names[i]);
+            ok = 0;
+            continue;
+        }
+
+        t.repo_name = basename_simple(db_names[i]);
+        t.path = push_copy;
+        t.action = "Upload";
+        t.fields = "";
+        if (!session_transfer(&hs, &t, push_with_libcurl, push_with_curl_exec)) {
+            omi_warn("Failed to push %s", db_names[i]);
+            ok = 0;
+        } else {
+            omi_info("Successfully pushed %s to %s\n", db_names[i], s->repos);
+            report_wire_bytes(&hs, t.path);
+        }
+        remove(push_copy);
+    }
+    http_session_end(&hs);
+    return ok;
+}
+
+int omi_pull(const OmiSettings *s, const char **db_names, int count, const OmiPullFilter *filter) {
+    HttpSession hs;
+    char filter_fields[MAX_LINE] = "";
+    int ok = 1;
+    int i;
+
+    if (strcmp(s->api_enabled, "0") == 0) {
+        omi_warn("API is disabled");
+        return 0;
+    }
+
+    if (filter && filter->blob_limit > 0) {
+        sprintf(filter_fields, "&filter_blob_limit=%ld", filter->blob_limit);
+    }
+    if (filter && filter->path_glob && filter->path_glob[0]) {
+        char glob[MAX_PATH_LEN * 3];
+        size_t n = strlen(filter_fields);
+        url_encode(filter->path_glob, glob, sizeof(glob));
+        snprintf(filter_fields + n, sizeof(filter_fields) - n, "&filter_path=%s", glob);
+    }
+
+    http_session_begin(&hs, s);
+    for (i = 0; i < count; ++i) {
+        Transfer t;
+        /* Stale WAL frames must not be replayed onto the downloaded file */
+        checkpoint_db(db_names[i]);
+        t.repo_name = basename_simple(db_names[i]);
+        t.path = db_names[i];
+        t.action = "pull";
+        t.fields = filter_fields;
+        if (!session_transfer(&hs, &t, download_with_libcurl, download_with_curl_exec)) {
+            omi_warn("Failed to pull %s", db_names[i]);
+            ok = 0;
+        } else {
+            long promised = count_rows(db_names[i], "promised");
+            omi_info("Successfully pulled %s from %s\n", db_names[i], s->repos);
+            report_wire_bytes(&hs, db_names[i]);
+            if (promised > 0) {
+                omi_info("Partial clone: %ld blobs will be fetched on demand\n", promised);
+            }
+        }
+    }
+    http_session_end(&hs);
+    return ok;
+}
+
+/*
+ * Partial clone. A filtered pull leaves large blobs on the server and lists
+ * them in the promised table (hash, size). load_blob() fetches a promised
+ * blob the first time it is read; checkout prefetches everything it needs
+ * in batches. Fetched content is verified against its hash before it is
+ * stored, then the promise is dropped.
+ */
+
+#define OMI_FETCH_BATCH 256
+
+/* Latest version of every path as of commit ?1 */
+#define OMI_TREE_SQL \
+    "SELECT f.filename, f.hash, f.datetime, f.commit_id FROM files f " \
+    "WHERE f.commit_id <= ?1 AND f.id = (SELECT MAX(id) FROM files WHERE filename = f.filename AND commit_id <= ?1)"
+
+typedef struct Remote {
+    const OmiSettings *s;
+    const char *db_name;
+    HttpSession hs;
+    int active;
+} Remote;
+
+static void remote_init(Remote *rm, const OmiSettings *s, const char *db_name) {
+    memset(rm, 0, sizeof(Remote));
+    rm->s = s;
+    rm->db_name = db_name;
+}
+
+static void remote_end(Remote *rm) {
+    if (rm->active) http_session_end(&rm->hs);
+    rm->active = 0;
+}
+
+
+/* Copy verified blobs from a downloaded fetch file into the repository */
+static long merge_fetched_blobs(sqlite3 *db, const char *fetch_path) {
+    sqlite3_stmt *stmt;
+    sqlite3_stmt *ins;
+    sqlite3_stmt *del;
+    long merged = 0;
+
+    if (sqlite3_prepare_v2(db, "ATTACH ? AS fetched", -1, &stmt, 0) != SQLITE_OK) return 0;
+    sqlite3_bind_text(stmt, 1, fetch_path, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    sqlite3_finalize(stmt);
+
+    stmt = ins = del = NULL;
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK
+        && sqlite3_prepare_v2(db, "SELECT omi_unhex(hash), data, hash FROM fetched.blobs WHERE hash IN (SELECT hash FROM main.promised)", -1, &stmt, 0) == SQLITE_OK
+        && sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO main.blobs (hash, data, size) VALUES (?, ?, ?)", -1, &ins, 0) == SQLITE_OK
+        && sqlite3_prepare_v2(db, "DELETE FROM main.promised WHERE hash = ?", -1, &del, 0) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const u8 *hash = (const u8 *)sqlite3_column_blob(stmt, 0);
+            const u8 *data = (const u8 *)sqlite3_column_blob(stmt, 1);
+            int data_len = sqlite3_column_bytes(stmt, 1);
+            u8 check[OMI_HASH_LEN];
+            int rc;
+
+            if (sqlite3_column_bytes(stmt, 0) != OMI_HASH_LEN) continue;
+            sha256_digest(data, (size_t)data_len, check);
+            if (memcmp(check, hash, OMI_HASH_LEN) != 0) {
+                omi_warn("Fetched blob does not match its hash, ignored");
+                continue;
+            }
+
+            /* Keep the server's key so the files rows still match it */
+            sqlite3_bind_value(ins, 1, sqlite3_column_value(stmt, 2));
+            sqlite3_bind_blob(ins, 2, data, data_len, SQLITE_TRANSIENT);
+            sqlite3_bind_int(ins, 3, data_len);
+            rc = sqlite3_step(ins);
+            sqlite3_reset(ins);
+
+            if (rc == SQLITE_DONE) {
+                sqlite3_bind_value(del, 1, sqlite3_column_value(stmt, 2));
+                rc = sqlite3_step(del);
+                sqlite3_reset(del);
+            }
+            if (rc != SQLITE_DONE) {
+                omi_warn("Cannot store fetched blobs: %s", sqlite3_errmsg(db));
+                merged = -1;
+                break;
+            }
+            merged++;
+        }
+    } else {
+        merged = -1;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(ins);
+    sqlite3_finalize(del);
+    if (merged < 0) {
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        merged = 0;
+    } else {
+        sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    }
+    sqlite3_exec(db, "DETACH fetched", 0, 0, 0);
+    return merged;
+}
+
+/* Fetch up to OMI_FETCH_BATCH promised blobs in one request */
+static long remote_fetch(Remote *rm, sqlite3 *db, const u8 *hashes, size_t count) {
+    char fetch_path[MAX_PATH_LEN];
+    char *fields;
+    size_t i;
+    size_t n;
+    long merged = 0;
+    Transfer t;
+
+    if (!rm || !rm->s || count == 0) return 0;
+    if (strcmp(rm->s->api_enabled, "0") == 0) {
+        omi_warn("API is disabled, cannot fetch promised blobs");
+        return 0;
+    }
+
+    fields = (char *)malloc(count * (OMI_HASH_LEN * 2 + 1) + 16);
+    if (!fields) return 0;
+    strcpy(fields, "&hashes=");
+    n = strlen(fields);
+    for (i = 0; i < count; ++i) {
+        if (i > 0) fields[n++] = ',';
+        omi_hash_hex(hashes + i * OMI_HASH_LEN, fields + n, OMI_HASH_LEN * 2 + 1);
+        n += OMI_HASH_LEN * 2;
+    }
+    fields[n] = '\0';
+
+    if (!rm->active) {
+        http_session_begin(&rm->hs, rm->s);
+        rm->active = 1;
+    }
+
+    snprintf(fetch_path, sizeof(fetch_path), "%s.fetch", rm->db_name);
+    t.repo_name = basename_simple(rm->db_name);
+    t.path = fetch_path;
+    t.action = "fetch_blobs";
+    t.fields = fields;
+
+    if (session_transfer(&rm->hs, &t, download_with_libcurl, download_with_curl_exec)) {
+        merged = merge_fetched_blobs(db, fetch_path);
+    }
+    remove(fetch_path);
+    free(fields);
+    return merged;
+}
+
+/*
+ * Delta encoding. A delta rebuilds a target blob from a base blob. It holds
+ * the target length as a varint, then a list of ops:
+ *   0x01..0x7F      insert that many literal bytes, which follow
+ *   0x80 off len    copy len bytes from base offset off (both varints)
+ * The encoder indexes every OMI_DELTA_BLOCK-byte block of the base and
+ * looks up a rolling hash of the target in it, extending each match both
+ * ways, so appended or edited text becomes a few copies plus the new bytes.
+ */
+
+#define OMI_DELTA_BLOCK 16
+#define OMI_DELTA_HASH_MUL 0x01000193U
+#define OMI_DELTA_COPY 0x80
+#define OMI_DELTA_MAX_LITERAL 0x7F
+/* Blobs outside this range are always stored whole */
+#define OMI_DELTA_MIN_SIZE 256L
+#define OMI_DELTA_MAX_SIZE (64L * 1024L * 1024L)
+/* Hard limit on chain length, whatever DELTA_CHAIN says */
+#define OMI_DELTA_MAX_CHAIN 64
+
+static size_t put_varint(u8 *out, unsigned long value) {
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        out[n++] = (u8)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (u8)value;
+    return n;
+}
+
+static int get_varint(const u8 **p, const u8 *end, unsigned long *out) {
+    unsigned long value = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 35) {
+        u8 c = *(*p)++;
+        value |= (unsigned long)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *out = value;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static u32 delta_block_hash(const u8 *p) {
+    u32 h = 0;
+    int i;
+
+    for (i = 0; i < OMI_DELTA_BLOCK; ++i) h = h * OMI_DELTA_HASH_MUL + p[i];
+    return h;
+}
+
+/* Write the delta of target against base into out. Returns its length, or 0
+ * when it would not fit in max_len bytes (then storing it whole is better). */
+static size_t delta_encode(const u8 *base, size_t base_len, const u8 *target, size_t target_len,
+                           u8 *out, size_t max_len) {
+    u32 *table;
+    u32 mask = 255;
+    u32 drop = 1;
+    u32 h = 0;
+    size_t op = 0;
+    size_t lit = 0;
+    size_t i = 0;
+    size_t off;
+
+    if (max_len < 32) return 0;
+    while (mask < base_len / OMI_DELTA_BLOCK * 2) mask = mask * 2 + 1;
+    table = (u32 *)calloc((size_t)mask + 1, sizeof(u32));
+    if (!table) return 0;
+    for (off = 0; off + OMI_DELTA_BLOCK <= base_len; off += OMI_DELTA_BLOCK) {
+        table[delta_block_hash(base + off) & mask] = (u32)off + 1;
+    }
+    for (off = 1; off < OMI_DELTA_BLOCK; ++off) drop *= OMI_DELTA_HASH_MUL;
+
+    op = put_varint(out, (unsigned long)target_len);
+    if (target_len >= OMI_DELTA_BLOCK) h = delta_block_hash(target);
+
+    while (i < target_len) {
+        u32 cand = (i + OMI_DELTA_BLOCK <= target_len) ? table[h & mask] : 0;
+
+        if (cand && memcmp(base + cand - 1, target + i, OMI_DELTA_BLOCK) == 0) {
+            size_t n = 0;
+            off = cand - 1;
+            while (off > 0 && i > lit && base[off - 1] == target[i - 1]) {
+                off--;
+                i--;
+            }
+            while (off + n < base_len && i + n < target_len && base[off + n] == target[i + n]) n++;
+
+            while (lit < i) {
+                size_t chunk = i - lit;
+                if (chunk > OMI_DELTA_MAX_LITERAL) chunk = OMI_DELTA_MAX_LITERAL;
+                if (op + 1 + chunk > max_len) goto too_big;
+                out[op++] = (u8)chunk;
+                memcpy(out + op, target + lit, chunk);
+                op += chunk;
+                lit += chunk;
+            }
+            if (op + 1 + 20 > max_len) goto too_big;
+            out[op++] = OMI_DELTA_COPY;
+            op += put_varint(out + op, (unsigned long)off);
+            op += put_varint(out + op, (unsigned long)n);
+
+            i += n;
+            lit = i;
+            if (i + OMI_DELTA_BLOCK <= target_len) h = delta_block_hash(target + i);
+            continue;
+        }
+
+        if (i + OMI_DELTA_BLOCK < target_len) {
+            h = (h - target[i] * drop) * OMI_DELTA_HASH_MUL + target[i + OMI_DELTA_BLOCK];
+        }
+        i++;
+    }
+
+    while (lit < target_len) {
+        size_t chunk = target_len - lit;
+        if (chunk > OMI_DELTA_MAX_LITERAL) chunk = OMI_DELTA_MAX_LITERAL;
+        if (op + 1 + chunk > max_len) goto too_big;
+        out[op++] = (u8)chunk;
+        memcpy(out + op, target + lit, chunk);
+        op += chunk;
+        lit += chunk;
+    }
+    free(table);
+    return op;
+
+too_big:
+    free(table);
+    return 0;
+}
+
+/* Rebuild a target from base and delta into a new buffer */
+static int delta_apply(const u8 *base, size_t base_len, const u8 *delta, size_t delta_len,
+                       u8 **out_data, size_t *out_len) {
+    const u8 *p = delta;
+    const u8 *end = delta + delta_len;
+    unsigned long target_len;
+    size_t pos = 0;
+    u8 *out;
+
+    if (!get_varint(&p, end, &target_len)) return 0;
+    out = (u8 *)malloc(target_len > 0 ? (size_t)target_len : 1);
+    if (!out) return 0;
+
+    while (p < end) {
+        u8 c = *p++;
+        if (c == OMI_DELTA_COPY) {
+            unsigned long off;
+            unsigned long n;
+            if (!get_varint(&p, end, &off) || !get_varint(&p, end, &n)
+                || off > base_len || n > base_len - off || n > target_len - pos) break;
+            memcpy(out + pos, base + off, (size_t)n);
+            pos += (size_t)n;
+        } else if (c >= 1 && c <= OMI_DELTA_MAX_LITERAL) {
+            if ((size_t)(end - p) < c || c > target_len - pos) break;
+            memcpy(out + pos, p, c);
+            p += c;
+            pos += c;
+        } else {
+            break;
+        }
+    }
+
+    if (p != end || pos != target_len) {
+        free(out);
+        return 0;
+    }
+    *out_data = out;
+    *out_len = pos;
+    return 1;
+}
+
+/* Recently rebuilt blobs, so reading neighbouring versions of a path does
+ * not replay the same chain again. Least recently used entries go first. */
+#define OMI_BLOB_CACHE_SLOTS 8
+#define OMI_BLOB_CACHE_BYTES (32L * 1024L * 1024L)
+
+typedef struct CachedBlob {
+    u8 hash[OMI_HASH_LEN];
+    u8 *data;
+    size_t len;
+    unsigned long used;
+} CachedBlob;
+
+typedef struct BlobCache {
+    CachedBlob slot[OMI_BLOB_CACHE_SLOTS];
+    size_t bytes;
+    unsigned long tick;
+} BlobCache;
+
+/* Returns a copy the caller frees, or NULL */
+static u8 *blob_cache_get(BlobCache *c, const u8 *hash, size_t *out_len) {
+    int i;
+
+    for (i = 0; i < OMI_BLOB_CACHE_SLOTS; ++i) {
+        CachedBlob *e = &c->slot[i];
+        if (e->data && memcmp(e->hash, hash, OMI_HASH_LEN) == 0) {
+            u8 *copy = (u8 *)malloc(e->len > 0 ? e->len : 1);
+            if (!copy) return NULL;
+            memcpy(copy, e->data, e->len);
+            e->used = ++c->tick;
+            *out_len = e->len;
+            return copy;
+        }
+    }
+    return NULL;
+}
+
+static void blob_cache_put(BlobCache *c, const u8 *hash, const u8 *data, size_t len) {
+    CachedBlob *slot;
+    int i;
+
+    if (len > (size_t)OMI_BLOB_CACHE_BYTES / 2) return;
+    for (i = 0; i < OMI_BLOB_CACHE_SLOTS; ++i) {
+        if (c->slot[i].data && memcmp(c->slot[i].hash, hash, OMI_HASH_LEN) == 0) return;
+    }
+
+    /* Evict until there is a free slot and room in the budget */
+    for (;;) {
+        CachedBlob *oldest = NULL;
+        slot = NULL;
+        for (i = 0; i < OMI_BLOB_CACHE_SLOTS; ++i) {
+            CachedBlob *e = &c->slot[i];
+            if (!e->data) {
+                if (!slot) slot = e;
+            } else if (!oldest || e->used < oldest->used) {
+                oldest = e;
+            }
+        }
+        if (slot && c->bytes + len <= (size_t)OMI_BLOB_CACHE_BYTES) break;
+        c->bytes -= oldest->len;
+        free(oldest->data);
+        oldest->data = NULL;
+    }
+
+    slot->data = (u8 *)malloc(len > 0 ? len : 1);
+    if (!slot->data) return;
+    memcpy(slot->data, data, len);
+    memcpy(slot->hash, hash, OMI_HASH_LEN);
+    slot->len = len;
+    slot->used = ++c->tick;
+    c->bytes += len;
+}
+
+static void blob_cache_free(BlobCache *c) {
+    int i;
+
+    for (i = 0; i < OMI_BLOB_CACHE_SLOTS; ++i) free(c->slot[i].data);
+    memset(c, 0, sizeof(BlobCache));
+}
+
+/*
+ * Repository handle. Statements are prepared on first use and kept for the
+ * life of the handle; repo_stmt() hands one back reset and unbound. Callers
+ * reset a statement when they are done with it so no read transaction is
+ * left open between operations.
+ *
+ * A handle that finds another writer holding the repository stages into its
+ * own journal, <db>-stage-<pid>-<time>-<n>, attached as schema "stage".
+ * Creating one writes nothing in the repository: commit finds journals by
+ * file name and moves their staged files in, each journal in one
+ * transaction. Status only reads them.
+ *
+ * In batch mode (omi_batch_begin) adds share one transaction that stays
+ * open until an operation other than add needs the handle, so an import
+ * pays for one transaction per commit instead of one per file. Each add
+ * runs in a savepoint inside it, so a failed add undoes only itself.
+ */
+
+enum {
+    STMT_INSERT_BLOB,
+    STMT_INSERT_STAGING,
+    STMT_JOURNAL_BLOB,
+    STMT_JOURNAL_STAGING,
+    STMT_SELECT_BLOB,
+    STMT_IS_PROMISED,
+    STMT_INSERT_COMMIT,
+    STMT_COMMIT_STAGING,
+    STMT_CLEAR_STAGING,
+    STMT_LATEST_COMMIT,
+    STMT_FILE_AT_COMMIT,
+    STMT_COMMITS,
+    STMT_STAGED,
+    STMT_TREE,
+    STMT_SELECT_DELTA,
+    STMT_NEW_BLOBS,
+    STMT_PREV_VERSION,
+    STMT_INSERT_DELTA,
+    STMT_CLEAR_BLOB_DATA,
+    STMT_COMMIT_BY_ID,
+    STMT_PATH_VERSIONS,
+    STMT_BLAME_CACHED,
+    STMT_INSERT_BLAME,
+    STMT_COUNT
+};
+
+static const char *const stmt_sql[STMT_COUNT] = {
+    "INSERT OR IGNORE INTO blobs (hash, data, size) VALUES (omi_key(?), ?, ?)",
+    "INSERT INTO staging (filename, hash, datetime) VALUES (?, omi_key(?), ?)",
+    "INSERT OR IGNORE INTO stage.blobs (hash, data, size) VALUES (omi_key(?), ?, ?)",
+    "INSERT INTO stage.staging (filename, hash, datetime) VALUES (?, omi_key(?), ?)",
+    "SELECT data FROM blobs WHERE hash " OMI_HASH_IN("?1"),
+    "SELECT 1 FROM promised WHERE hash " OMI_HASH_IN("?1"),
+    "INSERT INTO commits (message, datetime, user) VALUES (?, ?, ?)",
+    /* rowid, as staging from the web UI and omi.lua has no id column */
+    "INSERT INTO files (filename, hash, datetime, commit_id) SELECT filename, hash, datetime, ? FROM staging ORDER BY rowid",
+    "DELETE FROM staging",
+    "SELECT MAX(id) FROM commits",
+    "SELECT omi_unhex(hash) FROM files WHERE filename = ? AND commit_id <= ? ORDER BY id DESC LIMIT 1",
+    "SELECT id, message, datetime, user FROM commits ORDER BY id DESC",
+    "SELECT filename, omi_unhex(hash), datetime, 0 FROM (SELECT 0 AS src, rowid AS id, filename, hash, datetime FROM main.staging "
+    "UNION ALL SELECT 1, id, filename, hash, datetime FROM temp.journal_staged) ORDER BY src, id",
+    "SELECT filename, omi_unhex(hash), datetime, commit_id FROM (" OMI_TREE_SQL ") ORDER BY filename",
+    "SELECT base, data FROM deltas WHERE hash = ?",
+    /* Blobs first referenced by commit ?1, between ?2 and ?3 bytes */
+    "SELECT f.filename, omi_unhex(f.hash), b.data FROM files f JOIN blobs b ON b.hash = f.hash "
+    "WHERE f.commit_id = ?1 AND b.data IS NOT NULL AND b.size BETWEEN ?2 AND ?3 "
+    "AND NOT EXISTS (SELECT 1 FROM files o WHERE o.hash = f.hash AND o.commit_id <> ?1) ORDER BY f.id",
+    "SELECT omi_unhex(f.hash), COALESCE((SELECT depth FROM deltas WHERE hash = omi_unhex(f.hash)), 0) FROM files f "
+    "WHERE f.filename = ?1 AND f.commit_id <> ?2 ORDER BY f.id DESC LIMIT 1",
+    "INSERT INTO deltas (hash, base, depth, data) VALUES (?, ?, ?, ?)",
+    "UPDATE blobs SET data = NULL WHERE hash " OMI_HASH_IN("?1"),
+    "SELECT id, message, datetime, user FROM commits WHERE id = ?",
+    "SELECT id, omi_unhex(hash), commit_id FROM files WHERE filename = ?1 AND commit_id <= ?2 ORDER BY id",
+    /* Newest version of the path whose line origins are cached */
+    "SELECT f.id, c.origins FROM files f JOIN blame_cache c ON c.tip = f.id AND c.hash = omi_unhex(f.hash) "
+    "WHERE f.filename = ?1 AND f.commit_id <= ?2 ORDER BY f.id DESC LIMIT 1",
+    "INSERT OR REPLACE INTO blame_cache (hash, tip, origins) VALUES (?, ?, ?)"
+};
+
+struct OmiRepo {
+    sqlite3 *db;
+    char db_name[MAX_PATH_LEN];
+    OmiSettings settings;
+    sqlite3_stmt *stmts[STMT_COUNT];
+    Remote remote;
+    BlobCache cache;
+    char journal[MAX_SMALL];
+    int journal_attached;
+    int batching;
+    /* A batch transaction holding staged adds is open */
+    int batch_open;
+    int wal;
+    char errmsg[MAX_LINE];
+};
+
+struct OmiIter {
+    OmiRepo *repo;
+    sqlite3_stmt *stmt;
+    int owned;
+    int failed;
+};
+
+/* Records the error on the handle and reports it; returns 0 for chaining */
+static int repo_error(OmiRepo *repo, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(repo->errmsg, sizeof(repo->errmsg), fmt, ap);
+    va_end(ap);
+    omi_warn("%s", repo->errmsg);
+    return 0;
+}
+
+/* Writers switch the repository (and journals attached later) to WAL, which
+ * persists in the file. Read-only commands leave the journal mode alone, and
+ * push uploads a copy in the rollback journal mode (see write_push_copy). */
+static void repo_use_wal(OmiRepo *repo) {
+#ifndef OMI_AMIGA
+    /* WAL needs shared memory, which AmigaOS SQLite builds lack */
+    if (repo->wal) return;
+    repo->wal = 1;
+    sqlite3_exec(repo->db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+    sqlite3_exec(repo->db, "PRAGMA synchronous = NORMAL", 0, 0, 0);
+#else
+    (void)repo;
+#endif
+}
+
+static sqlite3_stmt *repo_stmt(OmiRepo *repo, int id) {
+    sqlite3_stmt *stmt = repo->stmts[id];
+
+    if (stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        return stmt;
+    }
+    if (sqlite3_prepare_v2(repo->db, stmt_sql[id], -1, &stmt, 0) != SQLITE_OK) {
+        return NULL;
+    }
+    repo->stmts[id] = stmt;
+    return stmt;
+}
+
+static void timestamp_now(char *out, size_t out_len) {
+    time_t now = time(NULL);
+    strftime(out, out_len, "%Y-%m-%d %H:%M:%S", gmtime(&now));
+}
+
+static unsigned long process_id(void) {
+#if defined(OMI_WINDOWS)
+    return (unsigned long)GetCurrentProcessId();
+#elif defined(OMI_POSIX)
+    return (unsigned long)getpid();
+#else
+    return (unsigned long)time(NULL);
+#endif
+}
+
+static void journal_path(const OmiRepo *repo, const char *name, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s-%s", repo->db_name, name);
+}
+
+/* Prepare, bind ?1 (if used) and run one statement to completion */
+static int exec_bound(sqlite3 *db, const char *sql, const char *arg) {
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) return 0;
+    if (sqlite3_bind_parameter_count(stmt) > 0) {
+        sqlite3_bind_text(stmt, 1, arg, -1, SQLITE_STATIC);
+    }
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE || rc == SQLITE_ROW;
+}
+
+/* 0 only when the process is known to be gone; unknown counts as alive */
+static int process_alive(unsigned long pid) {
+#if defined(OMI_WINDOWS)
+    HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+    DWORD rc;
+
+    if (!h) return GetLastError() != ERROR_INVALID_PARAMETER;
+    rc = WaitForSingleObject(h, 0);
+    CloseHandle(h);
+    return rc == WAIT_TIMEOUT;
+#elif defined(OMI_POSIX) && !defined(OMI_AMIGA)
+    return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+#else
+    (void)pid;
+    return 1;
+#endif
+}
+
+/* SQLite's own files next to a journal: <journal>-journal, -wal, -shm */
+static int journal_companion(const char *name) {
+    const char *dash = strrchr(name, '-');
+    return dash && (strcmp(dash, "-journal") == 0 || strcmp(dash, "-wal") == 0 || strcmp(dash, "-shm") == 0);
+}
+
+/* Names ("stage-...") of the journal files next to the repository */
+static void list_journals(const OmiRepo *repo, PathList *out) {
+    const char *base = basename_simple(repo->db_name);
+    char prefix[MAX_PATH_LEN];
+    size_t prefix_len;
+#ifdef OMI_WINDOWS
+    WIN32_FIND_DATAA ffd;
+    HANDLE h;
+    char search[MAX_PATH_LEN + 16];
+#else
+    char dir[MAX_PATH_LEN];
+    size_t dir_len = (size_t)(base - repo->db_name);
+    DIR *d;
+    struct dirent *entry;
+#endif
+
+    snprintf(prefix, sizeof(prefix), "%s-stage-", base);
+    prefix_len = strlen(prefix) - 6;
+#ifdef OMI_WINDOWS
+    snprintf(search, sizeof(search), "%s-stage-*", repo->db_name);
+    h = FindFirstFileA(search, &ffd);
+    if (h == INVALID_HANDLE_VALUE) return;
+    do {
+        if (!journal_companion(ffd.cFileName)) path_list_push(out, ffd.cFileName + prefix_len);
+    } while (FindNextFileA(h, &ffd) != 0);
+    FindClose(h);
+#else
+    if (dir_len == 0 || dir_len >= sizeof(dir)) {
+        strcpy(dir, ".");
+    } else {
+        memcpy(dir, repo->db_name, dir_len);
+        dir[dir_len] = '\0';
+    }
+    d = opendir(dir);
+    if (!d) return;
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len + 6) == 0 && !journal_companion(entry->d_name)) {
+            path_list_push(out, entry->d_name + prefix_len);
+        }
+    }
+    closedir(d);
+#endif
+}
+
+/* Create this handle's journal and attach it as "stage" */
+static int journal_open(OmiRepo *repo) {
+    static unsigned journal_seq = 0;
+    char path[MAX_PATH_LEN + MAX_SMALL];
+    int ok;
+
+    if (repo->journal_attached) return 1;
+    /* The pid lets a commit reclaim the journal of a writer that crashed; the
+     * time keeps a reused pid from picking up an old journal's watermark */
+    sprintf(repo->journal, "stage-%lu-%lu-%u", process_id(), (unsigned long)time(NULL), ++journal_seq);
+    journal_path(repo, repo->journal, path, sizeof(path));
+
+    /* Only the journal is written, so this never waits for the writer that
+     * holds the repository. The state table goes last: a journal without it
+     * is still being created. */
+    ok = exec_bound(repo->db, "ATTACH ? AS stage", path);
+#ifndef OMI_AMIGA
+    /* Like the repository, so omi status never blocks the journal's writer */
+    if (ok) sqlite3_exec(repo->db, "PRAGMA stage.journal_mode = WAL", 0, 0, 0);
+#endif
+    ok = ok && exec_bound(repo->db, "BEGIN", 0)
+        && exec_bound(repo->db, "CREATE TABLE IF NOT EXISTS stage.blobs (hash BLOB PRIMARY KEY, data BLOB, size INTEGER) WITHOUT ROWID", 0)
+        && exec_bound(repo->db, "CREATE TABLE IF NOT EXISTS stage.staging (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash BLOB, datetime TEXT)", 0)
+        && exec_bound(repo->db, "CREATE TABLE IF NOT EXISTS stage.state (closed INTEGER NOT NULL)", 0)
+        && exec_bound(repo->db, "INSERT INTO stage.state (closed) VALUES (0)", 0)
+        && exec_bound(repo->db, "COMMIT", 0);
+    if (!ok) {
+        repo_error(repo, "Cannot open staging journal %s: %s", path, sqlite3_errmsg(repo->db));
+        sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+        sqlite3_exec(repo->db, "DETACH stage", 0, 0, 0);
+        return 0;
+    }
+    repo->journal_attached = 1;
+    return 1;
+}
+
+/* Closed flag of an attached journal, -1 while its writer is still creating it */
+static int journal_state(OmiRepo *repo, const char *schema) {
+    sqlite3_stmt *stmt;
+    char sql[MAX_SMALL];
+    int state = -1;
+
+    sprintf(sql, "SELECT closed FROM %s.state", schema);
+    if (sqlite3_prepare_v2(repo->db, sql, -1, &stmt, 0) != SQLITE_OK) return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) state = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return state;
+}
+
+/* Move one journal's staged files into the repository. The merged watermark
+ * commits with the copied rows, so a journal whose cleanup was interrupted is
+ * never staged twice. */
+static int journal_absorb(OmiRepo *repo, const char *schema, const char *name) {
+    char sql[7][320];
+    int ok = 1;
+    int i;
+
+    strcpy(sql[0], OMI_JOURNALS_SQL);
+    strcpy(sql[1], "INSERT OR IGNORE INTO main.journals (name) VALUES (?1)");
+    sprintf(sql[2], "INSERT OR IGNORE INTO main.blobs (hash, data, size) SELECT hash, data, size FROM %s.blobs", schema);
+    sprintf(sql[3], "INSERT INTO main.staging (filename, hash, datetime) SELECT filename, hash, datetime FROM %s.staging "
+                    "WHERE id > (SELECT merged FROM main.journals WHERE name = ?1) ORDER BY id", schema);
+    sprintf(sql[4], "UPDATE main.journals SET merged = (SELECT MAX(id) FROM %s.staging) "
+                    "WHERE name = ?1 AND (SELECT MAX(id) FROM %s.staging) > merged", schema, schema);
+    sprintf(sql[5], "DELETE FROM %s.staging WHERE id <= (SELECT merged FROM main.journals WHERE name = ?1)", schema);
+    sprintf(sql[6], "DELETE FROM %s.blobs WHERE hash NOT IN (SELECT hash FROM %s.staging)", schema, schema);
+
+    if (sqlite3_exec(repo->db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(repo, "Cannot merge staging journal %s: %s", name, sqlite3_errmsg(repo->db));
+    }
+    for (i = 0; i < 7 && ok; ++i) {
+        ok = exec_bound(repo->db, sql[i], name);
+    }
+    if (!ok || sqlite3_exec(repo->db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        repo_error(repo, "Cannot merge staging journal %s: %s", name, sqlite3_errmsg(repo->db));
+        sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/* Merge every journal, then delete the ones whose writer closed them or
+ * died without doing so */
+static int absorb_journals(OmiRepo *repo) {
+    PathList names;
+    PathList finished;
+    char path[MAX_PATH_LEN + MAX_SMALL];
+    int ok = 1;
+    size_t i;
+
+    if (repo->journal_attached && !journal_absorb(repo, "stage", repo->journal)) ok = 0;
+
+    memset(&names, 0, sizeof(names));
+    memset(&finished, 0, sizeof(finished));
+    list_journals(repo, &names);
+
+    for (i = 0; i < names.count; ++i) {
+        unsigned long pid = 0;
+        int state;
+
+        if (strcmp(names.items[i], repo->journal) == 0) continue;
+        journal_path(repo, names.items[i], path, sizeof(path));
+        if (!exec_bound(repo->db, "ATTACH ? AS journal", path)) {
+            ok = repo_error(repo, "Cannot open staging journal %s: %s", path, sqlite3_errmsg(repo->db));
+            continue;
+        }
+        state = journal_state(repo, "journal");
+        sscanf(names.items[i], "stage-%lu-", &pid);
+        if (state >= 0 && !journal_absorb(repo, "journal", names.items[i])) {
+            /* Keep it: the next commit retries */
+            ok = 0;
+        } else if (state == 1 || !process_alive(pid)) {
+            path_list_push(&finished, names.items[i]);
+        }
+        sqlite3_exec(repo->db, "DETACH journal", 0, 0, 0);
+    }
+
+    if (finished.count > 0 && sqlite3_exec(repo->db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK) {
+        exec_bound(repo->db, OMI_JOURNALS_SQL, 0);
+        for (i = 0; i < finished.count; ++i) {
+            if (exec_bound(repo->db, "DELETE FROM journals WHERE name = ?", finished.items[i])) {
+                journal_path(repo, finished.items[i], path, sizeof(path));
+                remove(path);
+            }
+        }
+        sqlite3_exec(repo->db, "COMMIT", 0, 0, 0);
+    }
+
+    path_list_free(&names);
+    path_list_free(&finished);
+    return ok;
+}
+
+/* Staged rows of one attached journal that commit has not merged yet */
+static int journal_collect(OmiRepo *repo, const char *schema, const char *name) {
+    sqlite3_stmt *stmt;
+    char sql[MAX_SMALL * 2];
+    long merged = 0;
+
+    /* No journals table or row yet: nothing was merged */
+    if (sqlite3_prepare_v2(repo->db, "SELECT merged FROM main.journals WHERE name = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) merged = (long)sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    sprintf(sql, "INSERT INTO temp.journal_staged (filename, hash, datetime) "
+                 "SELECT filename, hash, datetime FROM %s.staging WHERE id > %ld ORDER BY id", schema, merged);
+    return exec_bound(repo->db, sql, 0);
+}
+
+/* Fill temp.journal_staged from every journal without touching the repository */
+static int collect_journals(OmiRepo *repo) {
+    PathList names;
+    char path[MAX_PATH_LEN + MAX_SMALL];
+    size_t i;
+
+    if (!exec_bound(repo->db, "CREATE TEMP TABLE IF NOT EXISTS journal_staged "
+                              "(id INTEGER PRIMARY KEY, filename TEXT, hash BLOB, datetime TEXT)", 0)
+        || !exec_bound(repo->db, "DELETE FROM temp.journal_staged", 0)) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    if (repo->journal_attached) journal_collect(repo, "stage", repo->journal);
+
+    memset(&names, 0, sizeof(names));
+    list_journals(repo, &names);
+    for (i = 0; i < names.count; ++i) {
+        if (strcmp(names.items[i], repo->journal) == 0) continue;
+        journal_path(repo, names.items[i], path, sizeof(path));
+        if (!exec_bound(repo->db, "ATTACH ? AS journal", path)) continue;
+        if (journal_state(repo, "journal") >= 0) journal_collect(repo, "journal", names.items[i]);
+        sqlite3_exec(repo->db, "DETACH journal", 0, 0, 0);
+    }
+    path_list_free(&names);
+    return 1;
+}
+
+/* End the open batch transaction, making the adds staged so far durable */
+static int batch_flush(OmiRepo *repo) {
+    if (!repo->batch_open) return 1;
+    repo->batch_open = 0;
+    if (sqlite3_exec(repo->db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        repo_error(repo, "Cannot save staged files: %s", sqlite3_errmsg(repo->db));
+        sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+    return 1;
+}
+
+int omi_batch_begin(OmiRepo *repo) {
+    repo->batching = 1;
+    return 1;
+}
+
+int omi_batch_end(OmiRepo *repo) {
+    repo->batching = 0;
+    return batch_flush(repo);
+}
+
+OmiRepo *omi_repo_open(const char *db_path, const OmiSettings *s) {
+    OmiRepo *repo = (OmiRepo *)calloc(1, sizeof(OmiRepo));
+
+    if (!repo) return NULL;
+
+    if (db_path) {
+        strncpy(repo->db_name, db_path, sizeof(repo->db_name) - 1);
+    } else {
+        omi_read_dotomi(repo->db_name, sizeof(repo->db_name));
+    }
+    if (s) {
+        repo->settings = *s;
+    } else {
+        omi_settings_init(&repo->settings);
+    }
+
+    if (!open_db(repo->db_name, &repo->db)) {
+        free(repo);
+        return NULL;
+    }
+    remote_init(&repo->remote, &repo->settings, repo->db_name);
+    return repo;
+}
+
+void omi_close(OmiRepo *repo) {
+    int i;
+
+    if (!repo) return;
+    for (i = 0; i < STMT_COUNT; ++i) {
+        if (repo->stmts[i]) sqlite3_finalize(repo->stmts[i]);
+    }
+    batch_flush(repo);
+    remote_end(&repo->remote);
+    blob_cache_free(&repo->cache);
+    if (repo->journal_attached) {
+        /* Done writing: the next commit may delete the journal once merged */
+        exec_bound(repo->db, "UPDATE stage.state SET closed = 1", 0);
+    }
+    sqlite3_close(repo->db);
+    free(repo);
+}
+
+const char *omi_errmsg(const OmiRepo *repo) {
+    return repo ? repo->errmsg : "No repository";
+}
+
+static int is_promised(OmiRepo *repo, const u8 *hash) {
+    /* Only partial clones have a promised table */
+    sqlite3_stmt *stmt = repo_stmt(repo, STMT_IS_PROMISED);
+    int found;
+
+    if (!stmt) return 0;
+    sqlite3_bind_blob(stmt, 1, hash, OMI_HASH_LEN, SQLITE_STATIC);
+    found = (sqlite3_step(stmt) == SQLITE_ROW);
+    sqlite3_reset(stmt);
+    return found;
+}
+
+/* Returns 1 with the content, 2 if the blob is stored as a delta and 0 if
+ * the repository does not have it */
+static int read_stored_blob(OmiRepo *repo, const u8 *hash, u8 **out_data, size_t *out_len) {
+    sqlite3_stmt *stmt = repo_stmt(repo, STMT_SELECT_BLOB);
+    int found = 0;
+
+    if (!stmt) return 0;
+    sqlite3_bind_blob(stmt, 1, hash, OMI_HASH_LEN, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+            found = 2;
+        } else {
+            int len = sqlite3_column_bytes(stmt, 0);
+            u8 *data = (u8 *)malloc(len > 0 ? (size_t)len : 1);
+            if (data) {
+                memcpy(data, sqlite3_column_blob(stmt, 0), (size_t)len);
+                *out_data = data;
+                *out_len = (size_t)len;
+                found = 1;
+            }
+        }
+    }
+    sqlite3_reset(stmt);
+    return found;
+}
+
+/* Rebuild a delta-stored blob: walk its chain down to a whole or cached
+ * blob, then apply the deltas back up, caching every version rebuilt */
+static int load_delta(OmiRepo *repo, const u8 *hash, u8 **out_data, size_t *out_len) {
+    u8 chain[OMI_DELTA_MAX_CHAIN + 1][OMI_HASH_LEN];
+    u8 *delta[OMI_DELTA_MAX_CHAIN];
+    size_t delta_len[OMI_DELTA_MAX_CHAIN];
+    u8 *data = NULL;
+    size_t len = 0;
+    int depth = 0;
+    int i;
+
+    memcpy(chain[0], hash, OMI_HASH_LEN);
+    for (;;) {
+        sqlite3_stmt *stmt;
+        int is_delta = 0;
+
+        data = blob_cache_get(&repo->cache, chain[depth], &len);
+        if (data) break;
+
+        stmt = repo_stmt(repo, STMT_SELECT_DELTA);
+        if (!stmt) break;
+        sqlite3_bind_blob(stmt, 1, chain[depth], OMI_HASH_LEN, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW && depth < OMI_DELTA_MAX_CHAIN
+            && sqlite3_column_bytes(stmt, 0) == OMI_HASH_LEN) {
+            int n = sqlite3_column_bytes(stmt, 1);
+            delta[depth] = (u8 *)malloc(n > 0 ? (size_t)n : 1);
+            if (delta[depth]) {
+                memcpy(delta[depth], sqlite3_column_blob(stmt, 1), (size_t)n);
+                delta_len[depth] = (size_t)n;
+                memcpy(chain[depth + 1], sqlite3_column_blob(stmt, 0), OMI_HASH_LEN);
+                is_delta = 1;
+            }
+        }
+        sqlite3_reset(stmt);
+
+        if (!is_delta) {
+            if (read_stored_blob(repo, chain[depth], &data, &len) != 1) data = NULL;
+            break;
+        }
+        depth++;
+    }
+
+    for (i = depth - 1; i >= 0; --i) {
+        u8 *next = NULL;
+        size_t next_len = 0;
+        if (data && delta_apply(data, len, delta[i], delta_len[i], &next, &next_len)) {
+            blob_cache_put(&repo->cache, chain[i], next, next_len);
+        }
+        free(data);
+        free(delta[i]);
+        data = next;
+        len = next_len;
+    }
+
+    if (!data) {
+        return repo_error(repo, "Cannot rebuild delta-stored blob");
+    }
+    *out_data = data;
+    *out_len = len;
+    return 1;
+}
+
+/* Read a blob's content, fetching it first if it is only promised */
+static int load_blob(OmiRepo *repo, const u8 *hash, u8 **out_data, size_t *out_len) {
+    int attempt;
+
+    for (attempt = 0; attempt < 2; ++attempt) {
+        int found = read_stored_blob(repo, hash, out_data, out_len);
+
+        if (found == 1) return 1;
+        if (found == 2) return load_delta(repo, hash, out_data, out_len);
+        if (attempt > 0 || !is_promised(repo, hash)) break;
+        remote_fetch(&repo->remote, repo->db, hash, 1);
+    }
+    return 0;
+}
+
+/* Staging writer shared by single-file and bulk adds: one transaction and
+ * the handle's cached insert statements for the whole batch. */
+typedef struct Stager {
+    OmiRepo *repo;
+    int insert_blob;
+    int insert_staging;
+    /* Inside a batch transaction: release instead of commit */
+    int savepoint;
+    int failed;
+    char dt[64];
+} Stager;
+
+/* Insert into the journal once the handle uses one, else the repository */
+static int stager_target(Stager *st) {
+    st->insert_blob = st->repo->journal_attached ? STMT_JOURNAL_BLOB : STMT_INSERT_BLOB;
+    st->insert_staging = st->repo->journal_attached ? STMT_JOURNAL_STAGING : STMT_INSERT_STAGING;
+    return 1;
+}
+
+static int stager_savepoint(Stager *st) {
+    st->savepoint = 1;
+    if (sqlite3_exec(st->repo->db, "SAVEPOINT stage_add", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(st->repo, "%s", sqlite3_errmsg(st->repo->db));
+    }
+    return stager_target(st);
+}
+
+static int stager_open(Stager *st, OmiRepo *repo) {
+    int rc;
+
+    memset(st, 0, sizeof(Stager));
+    st->repo = repo;
+    timestamp_now(st->dt, sizeof(st->dt));
+    repo_use_wal(repo);
+
+    if (repo->batch_open) {
+        return stager_savepoint(st);
+    }
+
+    /* Stage straight into the repository when nobody else is writing. A
+     * handle that once found it locked keeps using its journal, so its own
+     * adds stay in order. */
+    if (!repo->journal_attached) {
+        sqlite3_busy_handler(repo->db, 0, 0);
+        rc = sqlite3_exec(repo->db, "BEGIN IMMEDIATE", 0, 0, 0);
+        sqlite3_busy_handler(repo->db, busy_backoff, 0);
+        if (rc == SQLITE_OK) {
+            repo->batch_open = repo->batching;
+            return repo->batch_open ? stager_savepoint(st) : stager_target(st);
+        }
+        if (rc != SQLITE_BUSY) {
+            return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+        }
+    }
+
+    if (!journal_open(repo)) {
+        return 0;
+    }
+    /* Deferred: only the journal gets locked, never the repository */
+    if (sqlite3_exec(repo->db, "BEGIN", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    repo->batch_open = repo->batching;
+    return repo->batch_open ? stager_savepoint(st) : stager_target(st);
+}
+
+static int stager_close(Stager *st) {
+    OmiRepo *repo = st->repo;
+
+    if (st->savepoint) {
+        if (st->failed) sqlite3_exec(repo->db, "ROLLBACK TO stage_add", 0, 0, 0);
+        sqlite3_exec(repo->db, "RELEASE stage_add", 0, 0, 0);
+        return !st->failed;
+    }
+    if (st->failed) {
+        sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+    if (sqlite3_exec(repo->db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+        sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+    return 1;
+}
+
+static int stage_data(void *ctx, const char *filename, const u8 *data, size_t data_len) {
+    Stager *st = (Stager *)ctx;
+    OmiRepo *repo = st->repo;
+    sqlite3_stmt *insert_blob;
+    sqlite3_stmt *insert_staging;
+    u8 hash[OMI_HASH_LEN];
+    int rc;
+
+    if (st->failed) return 0;
+
+    insert_blob = repo_stmt(repo, st->insert_blob);
+    insert_staging = repo_stmt(repo, st->insert_staging);
+    if (!insert_blob || !insert_staging) {
+        st->failed = 1;
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+
+    sha256_digest(data, data_len, hash);
+
+    /* Insert blob if missing */
+    sqlite3_bind_blob(insert_blob, 1, hash, OMI_HASH_LEN, SQLITE_STATIC);
+    sqlite3_bind_blob(insert_blob, 2, data, (int)data_len, SQLITE_STATIC);
+    sqlite3_bind_int(insert_blob, 3, (int)data_len);
+    rc = sqlite3_step(insert_blob);
+    sqlite3_reset(insert_blob);
+
+    /* Stage file */
+    if (rc == SQLITE_DONE) {
+        sqlite3_bind_text(insert_staging, 1, filename, -1, SQLITE_STATIC);
+        sqlite3_bind_blob(insert_staging, 2, hash, OMI_HASH_LEN, SQLITE_STATIC);
+        sqlite3_bind_text(insert_staging, 3, st->dt, -1, SQLITE_STATIC);
+        rc = sqlite3_step(insert_staging);
+        sqlite3_reset(insert_staging);
+    }
+
+    if (rc != SQLITE_DONE) {
+        st->failed = 1;
+        return repo_error(repo, "Cannot stage %s: %s", filename, sqlite3_errmsg(repo->db));
+    }
+    return 1;
+}
+
+int omi_add(OmiRepo *repo, const char *filename) {
+    Stager st;
+    int ok;
+
+    if (!file_exists(filename)) {
+        return repo_error(repo, "Cannot read file %s", filename);
+    }
+
+    if (!stager_open(&st, repo)) {
+        return 0;
+    }
+    ok = read_file_stdio(filename, stage_data, &st);
+    if (!ok) st.failed = 1;
+    return stager_close(&st) && ok;
+}
+
+/* Store target as a delta against base_hash if that at least halves it */
+static int deltify_blob(OmiRepo *repo, const u8 *hash, const u8 *base_hash, int depth,
+                        const u8 *target, size_t target_len) {
+    sqlite3_stmt *stmt;
+    u8 *base = NULL;
+    u8 *delta;
+    u8 *check = NULL;
+    size_t base_len = 0;
+    size_t delta_len;
+    size_t check_len = 0;
+    int found;
+    int rc = SQLITE_ERROR;
+
+    /* Never fetch here: a base that is only promised keeps the blob whole */
+    found = read_stored_blob(repo, base_hash, &base, &base_len);
+    if (found == 2) found = load_delta(repo, base_hash, &base, &base_len);
+    if (found != 1) return 1;
+
+    delta = (u8 *)malloc(target_len / 2);
+    delta_len = delta ? delta_encode(base, base_len, target, target_len, delta, target_len / 2) : 0;
+    if (delta_len == 0
+        || !delta_apply(base, base_len, delta, delta_len, &check, &check_len)
+        || check_len != target_len || memcmp(check, target, target_len) != 0) {
+        delta_len = 0;
+    }
+    free(base);
+    free(check);
+    if (delta_len == 0) {
+        free(delta);
+        return 1;
+    }
+
+    /* The next version of this path will most likely be based on this one */
+    blob_cache_put(&repo->cache, hash, target, target_len);
+
+    stmt = repo_stmt(repo, STMT_INSERT_DELTA);
+    if (stmt) {
+        sqlite3_bind_blob(stmt, 1, hash, OMI_HASH_LEN, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, base_hash, OMI_HASH_LEN, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, depth);
+        sqlite3_bind_blob(stmt, 4, delta, (int)delta_len, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    if (rc == SQLITE_DONE) {
+        stmt = repo_stmt(repo, STMT_CLEAR_BLOB_DATA);
+        rc = SQLITE_ERROR;
+        if (stmt) {
+            sqlite3_bind_blob(stmt, 1, hash, OMI_HASH_LEN, SQLITE_STATIC);
+            rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+    }
+    free(delta);
+    return rc == SQLITE_DONE;
+}
+
+/* With DELTA_CHAIN set, store each blob a commit adds as a delta against
+ * the previous version of the same path. A version whose chain would grow
+ * past DELTA_CHAIN stays whole and starts a new chain. */
+static int deltify_commit(OmiRepo *repo, int commit_id) {
+    sqlite3_stmt *blobs;
+    int chain = repo->settings.delta_chain;
+    int rc;
+
+    if (chain <= 0) return 1;
+    if (chain > OMI_DELTA_MAX_CHAIN) chain = OMI_DELTA_MAX_CHAIN;
+    if (sqlite3_exec(repo->db, OMI_DELTAS_SQL, 0, 0, 0) != SQLITE_OK) return 0;
+
+    blobs = repo_stmt(repo, STMT_NEW_BLOBS);
+    if (!blobs) return 0;
+    sqlite3_bind_int(blobs, 1, commit_id);
+    sqlite3_bind_int64(blobs, 2, OMI_DELTA_MIN_SIZE);
+    sqlite3_bind_int64(blobs, 3, OMI_DELTA_MAX_SIZE);
+
+    while ((rc = sqlite3_step(blobs)) == SQLITE_ROW) {
+        sqlite3_stmt *prev;
+        u8 hash[OMI_HASH_LEN];
+        u8 base_hash[OMI_HASH_LEN];
+        int depth = 0;
+
+        if (sqlite3_column_bytes(blobs, 1) != OMI_HASH_LEN) continue;
+        memcpy(hash, sqlite3_column_blob(blobs, 1), OMI_HASH_LEN);
+
+        prev = repo_stmt(repo, STMT_PREV_VERSION);
+        if (!prev) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+        sqlite3_bind_text(prev, 1, (const char *)sqlite3_column_text(blobs, 0), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(prev, 2, commit_id);
+        if (sqlite3_step(prev) == SQLITE_ROW && sqlite3_column_bytes(prev, 0) == OMI_HASH_LEN) {
+            memcpy(base_hash, sqlite3_column_blob(prev, 0), OMI_HASH_LEN);
+            depth = sqlite3_column_int(prev, 1) + 1;
+        }
+        sqlite3_reset(prev);
+        if (depth == 0 || depth > chain) continue;
+
+        if (!deltify_blob(repo, hash, base_hash, depth, (const u8 *)sqlite3_column_blob(blobs, 2),
+                          (size_t)sqlite3_column_bytes(blobs, 2))) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+    }
+    sqlite3_reset(blobs);
+    return rc == SQLITE_DONE;
+}
+
+int omi_commit(OmiRepo *repo, const char *message, int *out_commit_id) {
+    sqlite3_stmt *stmt;
+    int commit_id = 0;
+    int rc = SQLITE_ERROR;
+    char dt[64];
+
+    timestamp_now(dt, sizeof(dt));
+
+    if (!batch_flush(repo)) {
+        return 0;
+    }
+    repo_use_wal(repo);
+    /* A journal that cannot be merged now stays staged for the next commit */
+    absorb_journals(repo);
+
+    if (sqlite3_exec(repo->db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+
+    stmt = repo_stmt(repo, STMT_INSERT_COMMIT);
+    if (stmt) {
+        sqlite3_bind_text(stmt, 1, message, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, dt, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, repo->settings.username, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        commit_id = (int)sqlite3_last_insert_rowid(repo->db);
+    }
+
+    /* Staged rows become the commit's files in one statement */
+    if (rc == SQLITE_DONE) {
+        stmt = repo_stmt(repo, STMT_COMMIT_STAGING);
+        rc = stmt ? SQLITE_OK : SQLITE_ERROR;
+        if (stmt) {
+            sqlite3_bind_int(stmt, 1, commit_id);
+            rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+    }
+    if (rc == SQLITE_DONE && !deltify_commit(repo, commit_id)) {
+        rc = SQLITE_ERROR;
+    }
+    if (rc == SQLITE_DONE) {
+        stmt = repo_stmt(repo, STMT_CLEAR_STAGING);
+        rc = stmt ? sqlite3_step(stmt) : SQLITE_ERROR;
+        if (stmt) sqlite3_reset(stmt);
+    }
+
+    if (rc != SQLITE_DONE || sqlite3_exec(repo->db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        repo_error(repo, "Commit failed: %s", sqlite3_errmsg(repo->db));
+        sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+
+    if (out_commit_id) *out_commit_id = commit_id;
+    return 1;
+}
+
+/* Iterators share the cached statement unless it is already being stepped */
+static OmiIter *iter_open(OmiRepo *repo, int id) {
+    OmiIter *it = (OmiIter *)calloc(1, sizeof(OmiIter));
+
+    if (!it) {
+        repo_error(repo, "Out of memory");
+        return NULL;
+    }
+    it->repo = repo;
+
+    if (repo->stmts[id] && sqlite3_stmt_busy(repo->stmts[id])) {
+        if (sqlite3_prepare_v2(repo->db, stmt_sql[id], -1, &it->stmt, 0) != SQLITE_OK) {
+            it->stmt = NULL;
+        }
+        it->owned = 1;
+    } else {
+        it->stmt = repo_stmt(repo, id);
+    }
+
+    if (!it->stmt) {
+        repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+static int iter_step(OmiIter *it) {
+    int rc = sqlite3_step(it->stmt);
+
+    if (rc == SQLITE_ROW) return 1;
+    if (rc != SQLITE_DONE) {
+        repo_error(it->repo, "%s", sqlite3_errmsg(it->repo->db));
+        it->failed = 1;
+    }
+    sqlite3_reset(it->stmt);
+    return 0;
+}
+
+int omi_iter_failed(const OmiIter *it) {
+    return !it || it->failed;
+}
+
+void omi_iter_free(OmiIter *it) {
+    if (!it) return;
+    if (it->owned) {
+        sqlite3_finalize(it->stmt);
+    } else {
+        sqlite3_reset(it->stmt);
+    }
+    free(it);
+}
+
+OmiIter *omi_commits(OmiRepo *repo) {
+    return iter_open(repo, STMT_COMMITS);
+}
+
+int omi_commit_next(OmiIter *it, OmiCommit *out) {
+    if (!it || !iter_step(it)) return 0;
+
+    out->id = sqlite3_column_int(it->stmt, 0);
+    out->message = (const char *)sqlite3_column_text(it->stmt, 1);
+    out->datetime = (const char *)sqlite3_column_text(it->stmt, 2);
+    out->user = (const char *)sqlite3_column_text(it->stmt, 3);
+    if (!out->message) out->message = "";
+    if (!out->datetime) out->datetime = "";
+    if (!out->user) out->user = "";
+    return 1;
+}
+
+static int latest_commit_id(OmiRepo *repo) {
+    sqlite3_stmt *stmt = repo_stmt(repo, STMT_LATEST_COMMIT);
+    int id = 0;
+
+    if (!stmt) return 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        id = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return id;
+}
+
+OmiIter *omi_files(OmiRepo *repo, int commit_id) {
+    OmiIter *it;
+
+    if (commit_id <= 0) commit_id = latest_commit_id(repo);
+    it = iter_open(repo, STMT_TREE);
+    if (it) sqlite3_bind_int(it->stmt, 1, commit_id);
+    return it;
+}
+
+OmiIter *omi_staged(OmiRepo *repo) {
+    if (!batch_flush(repo)) return NULL;
+    /* Read only: journals are merged by commit */
+    if (!collect_journals(repo)) return NULL;
+    return iter_open(repo, STMT_STAGED);
+}
+
+int omi_file_next(OmiIter *it, OmiFile *out) {
+    if (!it) return 0;
+
+    while (iter_step(it)) {
+        if (sqlite3_column_bytes(it->stmt, 1) != OMI_HASH_LEN) continue;
+        out->filename = (const char *)sqlite3_column_text(it->stmt, 0);
+        memcpy(out->hash, sqlite3_column_blob(it->stmt, 1), OMI_HASH_LEN);
+        out->datetime = (const char *)sqlite3_column_text(it->stmt, 2);
+        out->commit_id = sqlite3_column_int(it->stmt, 3);
+        if (!out->filename) out->filename = "";
+        if (!out->datetime) out->datetime = "";
+        return 1;
+    }
+    return 0;
+}
+
+/* Batch-fetch every promised blob the tree of commit_id needs */
+static void prefetch_tree(OmiRepo *repo, int commit_id) {
+    sqlite3_stmt *stmt;
+    u8 *batch;
+    size_t count = 0;
+
+    if (sqlite3_prepare_v2(repo->db, "SELECT DISTINCT omi_unhex(t.hash) FROM (" OMI_TREE_SQL ") t JOIN promised p ON p.hash = t.hash", -1, &stmt, 0) != SQLITE_OK) {
+        return;
+    }
+    batch = (u8 *)malloc(OMI_FETCH_BATCH * OMI_HASH_LEN);
+    if (!batch) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    sqlite3_bind_int(stmt, 1, commit_id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 0) != OMI_HASH_LEN) continue;
+        memcpy(batch + count * OMI_HASH_LEN, sqlite3_column_blob(stmt, 0), OMI_HASH_LEN);
+        if (++count == OMI_FETCH_BATCH) {
+            remote_fetch(&repo->remote, repo->db, batch, count);
+            count = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (count > 0) remote_fetch(&repo->remote, repo->db, batch, count);
+    free(batch);
+}
+
+/* Refuse absolute paths and ".." so a repository cannot write outside the tree */
+static int safe_relative_path(const char *path) {
+    const char *p = path;
+
+    if (!path[0] || path[0] == '/' || path[0] == '\\' || strchr(path, ':')) return 0;
+    while (*p) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\\' || p[2] == '\0')
+            && (p == path || p[-1] == '/' || p[-1] == '\\')) {
+            return 0;
+        }
+        p++;
+    }
+    return 1;
+}
+
+static void make_parent_dirs(const char *path) {
+    char dir[MAX_PATH_LEN];
+    char *p;
+
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+
+    for (p = dir + 1; *p; ++p) {
+        if (*p == '/' || *p == '\\') {
+            char c = *p;
+            *p = '\0';
+#ifdef OMI_WINDOWS
+            _mkdir(dir);
+#else
+            mkdir(dir, 0755);
+#endif
+            *p = c;
+        }
+    }
+}
+
+static int write_file(const char *path, const u8 *data, size_t len) {
+    FILE *f;
+
+    make_parent_dirs(path);
+    f = fopen(path, "wb");
+    if (!f) return 0;
+    if (len > 0 && fwrite(data, 1, len, f) != len) {
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    return 1;
+}
+
+int omi_checkout(OmiRepo *repo, int commit_id, int *out_written, int *out_failed) {
+    sqlite3_stmt *stmt;
+    int written = 0;
+    int failed = 0;
+
+    if (!batch_flush(repo)) return 0;
+    if (commit_id <= 0) commit_id = latest_commit_id(repo);
+
+    prefetch_tree(repo, commit_id);
+
+    stmt = repo_stmt(repo, STMT_TREE);
+    if (!stmt) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    sqlite3_bind_int(stmt, 1, commit_id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *filename = (const char *)sqlite3_column_text(stmt, 0);
+        u8 hash[OMI_HASH_LEN];
+        u8 *data = NULL;
+        size_t len = 0;
+
+        if (!filename || sqlite3_column_bytes(stmt, 1) != OMI_HASH_LEN) continue;
+        memcpy(hash, sqlite3_column_blob(stmt, 1), OMI_HASH_LEN);
+
+        if (!safe_relative_path(filename)) {
+            repo_error(repo, "Refusing to write unsafe path %s", filename);
+            failed++;
+        } else if (!load_blob(repo, hash, &data, &len)) {
+            repo_error(repo, "Content of %s is not available", filename);
+            failed++;
+        } else if (!write_file(filename, data, len)) {
+            repo_error(repo, "Cannot write file %s", filename);
+            failed++;
+        } else {
+            written++;
+        }
+        free(data);
+    }
+    sqlite3_reset(stmt);
+
+    if (out_written) *out_written = written;
+    if (out_failed) *out_failed = failed;
+    return failed == 0;
+}
+
+int omi_cat(OmiRepo *repo, const char *filename, int commit_id, FILE *out) {
+    sqlite3_stmt *stmt;
+    u8 hash[OMI_HASH_LEN];
+    int found = 0;
+    u8 *data = NULL;
+    size_t len = 0;
+
+    if (!batch_flush(repo)) return 0;
+    if (commit_id <= 0) commit_id = latest_commit_id(repo);
+
+    stmt = repo_stmt(repo, STMT_FILE_AT_COMMIT);
+    if (!stmt) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, commit_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == OMI_HASH_LEN) {
+        memcpy(hash, sqlite3_column_blob(stmt, 0), OMI_HASH_LEN);
+        found = 1;
+    }
+    sqlite3_reset(stmt);
+
+    if (!found) {
+        return repo_error(repo, "%s not found in commit %d", filename, commit_id);
+    }
+    if (!load_blob(repo, hash, &data, &len)) {
+        return repo_error(repo, "Content of %s is not available", filename);
+    }
+    fwrite(data, 1, len, out);
+    free(data);
+    return 1;
+}
+
+/* Fetch every promised blob, turning a partial clone into a full one */
+int omi_fetch(OmiRepo *repo, long *out_fetched) {
+    sqlite3_stmt *stmt;
+    u8 *batch;
+    size_t count = 0;
+    long merged = 0;
+
+    if (out_fetched) *out_fetched = 0;
+    if (!batch_flush(repo)) return 0;
+    if (sqlite3_prepare_v2(repo->db, "SELECT omi_unhex(hash) FROM promised", -1, &stmt, 0) != SQLITE_OK) {
+        /* Not a partial clone: nothing to fetch */
+        return 1;
+    }
+
+    batch = (u8 *)malloc(OMI_FETCH_BATCH * OMI_HASH_LEN);
+    if (!batch) {
+        sqlite3_finalize(stmt);
+        return repo_error(repo, "Out of memory");
+    }
+
+    /* Collect first: merging deletes from promised while we read it */
+    for (;;) {
+        count = 0;
+        sqlite3_reset(stmt);
+        while (count < OMI_FETCH_BATCH && sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != OMI_HASH_LEN) continue;
+            memcpy(batch + count * OMI_HASH_LEN, sqlite3_column_blob(stmt, 0), OMI_HASH_LEN);
+            count++;
+        }
+        sqlite3_reset(stmt);
+        if (count == 0) break;
+        {
+            long got = remote_fetch(&repo->remote, repo->db, batch, count);
+            if (got <= 0) break;
+            merged += got;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    free(batch);
+
+    if (out_fetched) *out_fetched = merged;
+    if (count > 0) {
+        return repo_error(repo, "%lu promised blobs could not be fetched", (unsigned long)count);
+    }
+    return 1;
+}
+
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out;
+    char buf[65536];
+    size_t n;
+    int ok = 1;
+
+    if (!in) return 0;
+    out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            ok = 0;
+            break;
+        }
+    }
+    if (ferror(in)) ok = 0;
+    fclose(in);
+    if (fclose(out) != 0) ok = 0;
+    return ok;
+}
+
+/* Write every delta-stored blob out whole and drop the deltas table */
+static int expand_deltas(OmiRepo *repo) {
+    sqlite3_stmt *list = NULL;
+    sqlite3_stmt *update = NULL;
+    int ok;
+    int rc = SQLITE_DONE;
+
+    /* Shallow deltas first, so deeper ones find their base already whole */
+    ok = sqlite3_exec(repo->db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK
+        && sqlite3_prepare_v2(repo->db, "SELECT hash FROM deltas ORDER BY depth", -1, &list, 0) == SQLITE_OK
+        && sqlite3_prepare_v2(repo->db, "UPDATE blobs SET data = ?1 WHERE hash " OMI_HASH_IN("?2"), -1, &update, 0) == SQLITE_OK;
+    while (ok && (rc = sqlite3_step(list)) == SQLITE_ROW) {
+        u8 hash[OMI_HASH_LEN];
+        u8 *data;
+        size_t len;
+
+        if (sqlite3_column_bytes(list, 0) != OMI_HASH_LEN) continue;
+        memcpy(hash, sqlite3_column_blob(list, 0), OMI_HASH_LEN);
+        if (!load_blob(repo, hash, &data, &len)) {
+            ok = 0;
+            break;
+        }
+        sqlite3_bind_blob(update, 1, data, (int)len, SQLITE_STATIC);
+        sqlite3_bind_blob(update, 2, hash, OMI_HASH_LEN, SQLITE_STATIC);
+        ok = (sqlite3_step(update) == SQLITE_DONE);
+        sqlite3_reset(update);
+        free(data);
+    }
+    sqlite3_finalize(list);
+    sqlite3_finalize(update);
+
+    ok = ok && rc == SQLITE_DONE
+        && sqlite3_exec(repo->db, "DROP TABLE deltas", 0, 0, 0) == SQLITE_OK
+        && sqlite3_exec(repo->db, "COMMIT", 0, 0, 0) == SQLITE_OK;
+    if (!ok) sqlite3_exec(repo->db, "ROLLBACK", 0, 0, 0);
+    return ok;
+}
+
+/* Copy a repository for the server and the other clients: delta-stored
+ * blobs written out whole, and the rollback journal mode instead of WAL,
+ * which needs shared memory that AmigaOS SQLite builds lack */
+static int write_push_copy(const char *db_name, const OmiSettings *s, const char *copy_path) {
+    OmiRepo *repo;
+    int has_deltas = count_rows(db_name, "deltas") > 0;
+    int ok;
+
+    if (!copy_file(db_name, copy_path)) return 0;
+    repo = omi_repo_open(copy_path, s);
+    if (!repo) {
+        remove(copy_path);
+        return 0;
+    }
+    ok = (!has_deltas || expand_deltas(repo))
+        && sqlite3_exec(repo->db, "PRAGMA journal_mode = DELETE", 0, 0, 0) == SQLITE_OK;
+    omi_close(repo);
+    if (!ok) remove(copy_path);
+    return ok;
+}
+
+/* Statistics
+ *
+ * omi_stats scans blobs once into temp.stats_sizes (hash, size), which the
+ * other queries join, so the repository needs no extra index. All queries
+ * run in one read transaction and see the same snapshot. */
+
+#define OMI_STATS_DBSTAT_MAX (256.0 * 1024.0 * 1024.0)
+
+static int stats_bucket(double size) {
+    int bucket = 0;
+
+    while (size >= 1.0 && bucket < OMI_STATS_BUCKETS - 1) {
+        size /= 2.0;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Keep out->largest_blobs sorted by size, largest first */
+static void stats_keep_blob(OmiStats *out, int limit, const void *hash, double size, long refs) {
+    int pos = out->largest_blob_count;
+
+    if (pos == limit && size <= out->largest_blobs[limit - 1].size) return;
+    if (pos == limit) pos--;
+    else out->largest_blob_count++;
+    while (pos > 0 && out->largest_blobs[pos - 1].size < size) {
+        out->largest_blobs[pos] = out->largest_blobs[pos - 1];
+        pos--;
+    }
+    memset(&out->largest_blobs[pos], 0, sizeof(OmiStatsBlob));
+    memcpy(out->largest_blobs[pos].hash, hash, OMI_HASH_LEN);
+    out->largest_blobs[pos].size = size;
+    out->largest_blobs[pos].refs = refs;
+}
+
+static int stats_prepare(OmiRepo *repo, const char *sql, int limit, sqlite3_stmt **out) {
+    if (sqlite3_prepare_v2(repo->db, sql, -1, out, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    if (sqlite3_bind_parameter_count(*out) > 0) {
+        sqlite3_bind_int(*out, 1, limit);
+    }
+    return 1;
+}
+
+static long stats_count(OmiRepo *repo, const char *sql, double *out_sum) {
+    sqlite3_stmt *stmt;
+    long count = 0;
+
+    if (out_sum) *out_sum = 0;
+    if (sqlite3_prepare_v2(repo->db, sql, -1, &stmt, 0) != SQLITE_OK) return 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        count = (long)sqlite3_column_int64(stmt, 0);
+        if (out_sum && sqlite3_column_count(stmt) > 1) {
+            *out_sum = sqlite3_column_double(stmt, 1);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+static int stats_blobs(OmiRepo *repo, int limit, OmiStats *out) {
+    sqlite3_stmt *stmt;
+    int i;
+    int rc;
+
+    if (!stats_prepare(repo, "SELECT omi_unhex(b.hash), b.size, (SELECT COUNT(*) FROM files f WHERE f.hash = b.hash) FROM temp.stats_sizes b", 0, &stmt)) {
+        return 0;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        double size = sqlite3_column_double(stmt, 1);
+        long refs = (long)sqlite3_column_int64(stmt, 2);
+        int bucket = stats_bucket(size);
+
+        out->blobs++;
+        out->stored_bytes += size;
+        out->logical_bytes += size * refs;
+        if (refs == 0) out->unreferenced++;
+        out->histogram_count[bucket]++;
+        out->histogram_bytes[bucket] += size;
+        if (sqlite3_column_bytes(stmt, 0) == OMI_HASH_LEN) {
+            stats_keep_blob(out, limit, sqlite3_column_blob(stmt, 0), size, refs);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+
+    if (sqlite3_prepare_v2(repo->db, "SELECT filename FROM files WHERE hash " OMI_HASH_IN("?1") " ORDER BY id DESC LIMIT 1", -1, &stmt, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    for (i = 0; i < out->largest_blob_count; ++i) {
+        OmiStatsBlob *b = &out->largest_blobs[i];
+        sqlite3_bind_blob(stmt, 1, b->hash, OMI_HASH_LEN, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            copy_text(b->path, sizeof(b->path), sqlite3_column_text(stmt, 0));
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return 1;
+}
+
+static int stats_paths(OmiRepo *repo, int limit, OmiStats *out) {
+    sqlite3_stmt *stmt;
+
+    /* Each distinct version of a path counts once */
+    if (!stats_prepare(repo,
+            "SELECT filename, COUNT(*), SUM(size) FROM"
+            " (SELECT f.filename AS filename, b.size AS size FROM files f JOIN temp.stats_sizes b ON b.hash = f.hash GROUP BY f.filename, f.hash)"
+            " GROUP BY filename ORDER BY 3 DESC LIMIT ?1", limit, &stmt)) {
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && out->largest_path_count < limit) {
+        OmiStatsPath *p = &out->largest_paths[out->largest_path_count++];
+        copy_text(p->path, sizeof(p->path), sqlite3_column_text(stmt, 0));
+        p->versions = (long)sqlite3_column_int64(stmt, 1);
+        p->bytes = sqlite3_column_double(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    return 1;
+}
+
+static int stats_growth(OmiRepo *repo, int limit, OmiStats *out) {
+    sqlite3_stmt *stmt;
+
+    /* New blobs keyed by the commit that first referenced them, so both
+     * reports below join on a primary key */
+    sqlite3_exec(repo->db, "DROP TABLE IF EXISTS temp.stats_growth", 0, 0, 0);
+    if (sqlite3_exec(repo->db, "CREATE TEMP TABLE stats_growth (commit_id INTEGER PRIMARY KEY, blobs INTEGER, bytes INTEGER)", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    if (!stats_prepare(repo,
+            "INSERT INTO temp.stats_growth SELECT h.first, COUNT(*), SUM(b.size)"
+            " FROM (SELECT hash, MIN(commit_id) AS first FROM files GROUP BY hash) h"
+            " JOIN temp.stats_sizes b ON b.hash = h.hash GROUP BY h.first", 0, &stmt)) {
+        return 0;
+    }
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sqlite3_finalize(stmt);
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    sqlite3_finalize(stmt);
+
+    if (!stats_prepare(repo,
+            "SELECT c.id, c.user, c.datetime, COALESCE(g.blobs, 0), COALESCE(g.bytes, 0)"
+            " FROM commits c LEFT JOIN temp.stats_growth g ON g.commit_id = c.id"
+            " ORDER BY c.id DESC LIMIT ?1", limit, &stmt)) {
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && out->commit_growth_count < limit) {
+        OmiStatsGrowth *g = &out->commit_growth[out->commit_growth_count++];
+        g->commit_id = sqlite3_column_int(stmt, 0);
+        copy_text(g->user, sizeof(g->user), sqlite3_column_text(stmt, 1));
+        copy_text(g->datetime, sizeof(g->datetime), sqlite3_column_text(stmt, 2));
+        g->commits = 1;
+        g->blobs = (long)sqlite3_column_int64(stmt, 3);
+        g->bytes = sqlite3_column_double(stmt, 4);
+    }
+    sqlite3_finalize(stmt);
+
+    if (!stats_prepare(repo,
+            "SELECT c.user, COUNT(*), SUM(COALESCE(g.blobs, 0)), SUM(COALESCE(g.bytes, 0)), MAX(c.id)"
+            " FROM commits c LEFT JOIN temp.stats_growth g ON g.commit_id = c.id"
+            " GROUP BY c.user ORDER BY 4 DESC LIMIT ?1", limit, &stmt)) {
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && out->user_growth_count < limit) {
+        OmiStatsGrowth *g = &out->user_growth[out->user_growth_count++];
+        copy_text(g->user, sizeof(g->user), sqlite3_column_text(stmt, 0));
+        g->commits = (long)sqlite3_column_int64(stmt, 1);
+        g->blobs = (long)sqlite3_column_int64(stmt, 2);
+        g->bytes = sqlite3_column_double(stmt, 3);
+        g->commit_id = sqlite3_column_int(stmt, 4);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(repo->db, "DROP TABLE temp.stats_growth", 0, 0, 0);
+    return 1;
+}
+
+/* Delta-stored blobs take the size of their delta, not their full size */
+static void stats_deltas(OmiRepo *repo, OmiStats *out) {
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(repo->db, "SELECT COUNT(*), SUM(b.size), SUM(length(d.data)) FROM deltas d"
+            " JOIN temp.stats_sizes b ON b.hash " OMI_HASH_IN("d.hash"), -1, &stmt, 0) != SQLITE_OK) {
+        /* Repositories from before the delta store have no deltas table */
+        return;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        out->delta_blobs = (long)sqlite3_column_int64(stmt, 0);
+        out->delta_bytes = sqlite3_column_double(stmt, 2);
+        out->delta_saved = sqlite3_column_double(stmt, 1) - out->delta_bytes;
+        out->stored_bytes -= out->delta_saved;
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void stats_pages(OmiRepo *repo, int full_pages, OmiStats *out) {
+    sqlite3_stmt *stmt;
+
+    out->page_size = stats_count(repo, "PRAGMA page_size", NULL);
+    out->page_count = stats_count(repo, "PRAGMA page_count", NULL);
+    out->freelist_count = stats_count(repo, "PRAGMA freelist_count", NULL);
+
+    /* dbstat visits every page; skip it on large repositories unless asked */
+    if (!full_pages && (double)out->page_size * out->page_count > OMI_STATS_DBSTAT_MAX) return;
+    if (sqlite3_prepare_v2(repo->db,
+            "SELECT name, COUNT(*), SUM(pgsize), SUM(unused) FROM dbstat"
+            " GROUP BY name ORDER BY 3 DESC", -1, &stmt, 0) != SQLITE_OK) {
+        /* SQLite built without SQLITE_ENABLE_DBSTAT_VTAB */
+        return;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW && out->table_count < OMI_STATS_TABLES) {
+        OmiStatsTable *t = &out->tables[out->table_count++];
+        copy_text(t->name, sizeof(t->name), sqlite3_column_text(stmt, 0));
+        t->pages = (long)sqlite3_column_int64(stmt, 1);
+        t->bytes = sqlite3_column_double(stmt, 2);
+        t->unused = sqlite3_column_double(stmt, 3);
+    }
+    sqlite3_finalize(stmt);
+    out->pages_exact = 1;
+}
+
+/* One pass over blobs; an untyped hash keeps hex and binary keys as stored */
+static int stats_sizes(OmiRepo *repo) {
+    sqlite3_exec(repo->db, "DROP TABLE IF EXISTS temp.stats_sizes", 0, 0, 0);
+    if (sqlite3_exec(repo->db, "CREATE TEMP TABLE stats_sizes (hash PRIMARY KEY, size INTEGER)", 0, 0, 0) != SQLITE_OK
+        || sqlite3_exec(repo->db, "INSERT OR IGNORE INTO temp.stats_sizes SELECT hash, size FROM main.blobs", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    return 1;
+}
+
+int omi_stats(OmiRepo *repo, int limit, int full_pages, OmiStats *out) {
+    int ok;
+
+    memset(out, 0, sizeof(OmiStats));
+    if (limit <= 0 || limit > OMI_STATS_MAX) limit = OMI_STATS_MAX;
+    if (!batch_flush(repo)) return 0;
+
+    if (sqlite3_exec(repo->db, "BEGIN", 0, 0, 0) != SQLITE_OK) {
+        return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    }
+    ok = stats_sizes(repo)
+        && stats_blobs(repo, limit, out)
+        && stats_paths(repo, limit, out)
+        && stats_growth(repo, limit, out);
+    if (ok) {
+        out->file_versions = stats_count(repo, "SELECT COUNT(*) FROM files", NULL);
+        out->commits = stats_count(repo, "SELECT COUNT(*) FROM commits", NULL);
+        /* Only partial clones have a promised table */
+        out->promised = stats_count(repo, "SELECT COUNT(*), SUM(size) FROM promised", &out->promised_bytes);
+        stats_deltas(repo, out);
+        stats_pages(repo, full_pages, out);
+        /* Dedup only: delta savings are reported on their own */
+        if (out->stored_bytes + out->delta_saved > 0) {
+            out->dedup_ratio = out->logical_bytes / (out->stored_bytes + out->delta_saved);
+        }
+    }
+    sqlite3_exec(repo->db, "DROP TABLE IF EXISTS temp.stats_sizes", 0, 0, 0);
+    sqlite3_exec(repo->db, "COMMIT", 0, 0, 0);
+    return ok;
+}
+
+/* ===== Blame ===== */
+
+/* Line origins of a path version are cached by blob hash and the files row
+ * of that version (the tip of the path's history), as runs of (commit id,
+ * line count) varints. A later blame starts from the newest cached version
+ * at or before the one asked for and only diffs the versions after it. */
+#define OMI_BLAME_CACHE_SQL \
+    "CREATE TABLE IF NOT EXISTS blame_cache (hash BLOB NOT NULL, tip INTEGER NOT NULL, " \
+    "origins BLOB NOT NULL, PRIMARY KEY (hash, tip)) WITHOUT ROWID"
+/* Diffs needing more edits than this credit the whole changed middle to the
+ * newer commit, and omi_blame prints a note for each such version */
+#define OMI_BLAME_MAX_EDIT 2048L
+/* Long walks also cache every this many versions, for blames of older ones */
+#define OMI_BLAME_CHECKPOINT 256
+
+typedef struct BlameLines {
+    const u8 **text;
+    size_t *len;
+    u32 *hash;
+    size_t count;
+} BlameLines;
+
+typedef struct PathVersion {
+    long file_id;
+    int commit_id;
+    u8 hash[OMI_HASH_LEN];
+} PathVersion;
+
+static void blame_lines_free(BlameLines *l) {
+    free((void *)l->text);
+    free(l->len);
+    free(l->hash);
+    memset(l, 0, sizeof(BlameLines));
+}
+
+/* Split data at '\n'; a last line without one still counts */
+static int blame_lines_split(const u8 *data, size_t len, BlameLines *out) {
+    size_t count = 0;
+    size_t i;
+    size_t start = 0;
+
+    memset(out, 0, sizeof(BlameLines));
+    for (i = 0; i < len; ++i) {
+        if (data[i] == '\n') count++;
+    }
+    if (len > 0 && data[len - 1] != '\n') count++;
+    out->text = (const u8 **)malloc((count + 1) * sizeof(u8 *));
+    out->len = (size_t *)malloc((count + 1) * sizeof(size_t));
+    out->hash = (u32 *)malloc((count + 1) * sizeof(u32));
+    if (!out->text || !out->len || !out->hash) {
+        blame_lines_free(out);
+        return 0;
+    }
+    for (i = 0; i <= len; ++i) {
+        if (i < len && data[i] != '\n') continue;
+        if (i == len && start == len) break;
+        {
+            u32 h = 2166136261U;
+            size_t j;
+
+            for (j = start; j < i; ++j) h = (h ^ data[j]) * 16777619U;
+            out->text[out->count] = data + start;
+            out->len[out->count] = i - start;
+            out->hash[out->count] = h;
+            out->count++;
+        }
+        start = i + 1;
+    }
+    return 1;
+}
+
+static int blame_line_equal(const BlameLines *a, size_t i, const BlameLines *b, size_t j) {
+    return a->hash[i] == b->hash[j] && a->len[i] == b->len[j]
+        && memcmp(a->text[i], b->text[j], a->len[i]) == 0;
+}
+
+/* Myers diff of a[lo, lo + n) against b[lo, lo + m): lines b keeps from a
+ * take their origin from a_origin, the rest were written by commit_id.
+ * Returns 0 if the edit cap (or memory) ran out before the lines matched;
+ * then every line of b's middle stays credited to commit_id. */
+static int blame_diff_middle(const BlameLines *a, const BlameLines *b, size_t lo, long n, long m,
+                              const int *a_origin, int *b_origin, int commit_id) {
+    long max = n + m;
+    long *v;
+    long *trace = NULL;
+    long used = 0;
+    long cap = 0;
+    long d;
+    long x;
+    long y;
+    int found = 0;
+
+    for (y = 0; y < m; ++y) b_origin[lo + y] = commit_id;
+    if (n == 0 || m == 0) return 1;
+    if (max > OMI_BLAME_MAX_EDIT) max = OMI_BLAME_MAX_EDIT;
+
+    /* v[k] is the furthest x on diagonal k; trace keeps v[-d-1 .. d+1] as
+     * it was before each round d, which is all the backtrack reads */
+    v = (long *)calloc((size_t)(2 * max + 3), sizeof(long));
+    if (!v) return 0;
+    v += max + 1;
+    for (d = 0; d <= max && !found; ++d) {
+        long k;
+
+        if (used + 2 * d + 3 > cap) {
+            long grown = cap * 2 + 2 * d + 3;
+            long *p = (long *)realloc(trace, (size_t)grown * sizeof(long));
+            if (!p) break;
+            trace = p;
+            cap = grown;
+        }
+        memcpy(trace + used, v - d - 1, (size_t)(2 * d + 3) * sizeof(long));
+        used += 2 * d + 3;
+        for (k = -d; k <= d; k += 2) {
+            x = (k == -d || (k != d && v[k - 1] < v[k + 1])) ? v[k + 1] : v[k - 1] + 1;
+            y = x - k;
+            while (x < n && y < m && blame_line_equal(a, lo + x, b, lo + y)) {
+                x++;
+                y++;
+            }
+            v[k] = x;
+            if (x >= n && y >= m) {
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    if (found) {
+        x = n;
+        y = m;
+        for (d = d - 1; d >= 0; --d) {
+            const long *prev;
+            long k = x - y;
+            long prev_k;
+            long prev_x;
+
+            used -= 2 * d + 3;
+            prev = trace + used + d + 1;
+            prev_k = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+            prev_x = prev[prev_k];
+            while (x > prev_x && y > prev_x - prev_k) {
+                x--;
+                y--;
+                b_origin[lo + y] = a_origin[lo + x];
+            }
+            x = prev_x;
+            y = prev_x - prev_k;
+        }
+    }
+    free(v - max - 1);
+    free(trace);
+    return found;
+}
+
+/* Origins of b's lines given a's; b_origin holds b->count entries. Returns 0
+ * if the changed lines were too far apart to match (see blame_diff_middle). */
+static int blame_diff(const BlameLines *a, const int *a_origin, const BlameLines *b, int *b_origin, int commit_id) {
+    size_t pre = 0;
+    size_t suf = 0;
+
+    while (pre < a->count && pre < b->count && blame_line_equal(a, pre, b, pre)) {
+        b_origin[pre] = a_origin[pre];
+        pre++;
+    }
+    while (suf < a->count - pre && suf < b->count - pre
+           && blame_line_equal(a, a->count - 1 - suf, b, b->count - 1 - suf)) {
+        b_origin[b->count - 1 - suf] = a_origin[a->count - 1 - suf];
+        suf++;
+    }
+    /* Equal prefixes mean both middles start at line pre */
+    return blame_diff_middle(a, b, pre, (long)(a->count - pre - suf), (long)(b->count - pre - suf),
+                      a_origin, b_origin, commit_id);
+}
+
+/* Versions of path up to commit_id, oldest first */
+static int blame_versions(OmiRepo *repo, const char *path, int commit_id, PathVersion **out, size_t *out_count) {
+    sqlite3_stmt *stmt = repo_stmt(repo, STMT_PATH_VERSIONS);
+    PathVersion *list = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+
+    if (!stmt) return repo_error(repo, "%s", sqlite3_errmsg(repo->db));
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, commit_id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 1) != OMI_HASH_LEN) continue;
+        if (count == cap) {
+            size_t grown = cap ? cap * 2 : 64;
+            PathVersion *p = (PathVersion *)realloc(list, grown * sizeof(PathVersion));
+            if (!p) {
+                sqlite3_reset(stmt);
+                free(list);
+                return repo_error(repo, "Out of memory");
+            }
+            list = p;
+            cap = grown;
+        }
+        list[count].file_id = (long)sqlite3_column_int64(stmt, 0);
+        memcpy(list[count].hash, sqlite3_column_blob(stmt, 1), OMI_HASH_LEN);
+        list[count].commit_id = sqlite3_column_int(stmt, 2);
+        count++;
+    }
+    sqlite3_reset(stmt);
+    *out = list;
+    *out_count = count;
+    return 1;
+}
+
+/* Newest cached version: its index in versions and its encoded origins */
+static int blame_cached(OmiRepo *repo, const char *path, int commit_id, const PathVersion *versions,
+                        size_t count, size_t *out_index, u8 **out_data, size_t *out_len) {
+    sqlite3_stmt *stmt = repo_stmt(repo, STMT_BLAME_CACHED);
+    long file_id;
+    size_t i;
+    int found = 0;
+
+    /* No blame_cache table yet */
+    if (!stmt) return 0;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, commit_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        file_id = (long)sqlite3_column_int64(stmt, 0);
+        for (i = count; i-- > 0 && !found;) {
+            if (versions[i].file_id != file_id) continue;
+            *out_len = (size_t)sqlite3_column_bytes(stmt, 1);
+            *out_data = (u8 *)malloc(*out_len + 1);
+            if (*out_data) {
+                memcpy(*out_data, sqlite3_column_blob(stmt, 1), *out_len);
+                *out_index = i;
+                found = 1;
+            }
+        }
+    }
+    sqlite3_reset(stmt);
+    return found;
+}
+
+/* Runs of (commit id, line count); out needs 20 bytes per line */
+static size_t blame_encode(const int *origin, size_t count, u8 *out) {
+    size_t n = 0;
+    size_t i = 0;
+
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && origin[i + run] == origin[i]) run++;
+        n += put_varint(out + n, (unsigned long)origin[i]);
+        n += put_varint(out + n, (unsigned long)run);
+        i += run;
+    }
+    return n;
+}
+
+/* Fills origin (count entries); 0 if the runs do not cover exactly count lines */
+static int blame_decode(const u8 *data, size_t len, int *origin, size_t count) {
+    const u8 *p = data;
+    const u8 *end = data + len;
+    size_t i = 0;
+
+    while (p < end) {
+        unsigned long id;
+        unsigned long run;
+
+        if (!get_varint(&p, end, &id) || !get_varint(&p, end, &run) || run > count - i) return 0;
+        while (run-- > 0) origin[i++] = (int)id;
+    }
+    return i == count;
+}
+
+static void blame_store(OmiRepo *repo, const PathVersion *tip, const int *origin, size_t count) {
+    sqlite3_stmt *stmt;
+    u8 *buf;
+    size_t len;
+
+    /* A read-only repository simply goes without the cache */
+    if (sqlite3_exec(repo->db, OMI_BLAME_CACHE_SQL, 0, 0, 0) != SQLITE_OK) return;
+    stmt = repo_stmt(repo, STMT_INSERT_BLAME);
+    buf = (u8 *)malloc(count * 20 + 1);
+    if (!stmt || !buf) {
+        free(buf);
+        return;
+    }
+    len = blame_encode(origin, count, buf);
+    sqlite3_bind_blob(stmt, 1, tip->hash, OMI_HASH_LEN, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)tip->file_id);
+    sqlite3_bind_blob(stmt, 3, buf, (int)len, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    free(buf);
+}
+
+/* Calls fn for each line with the commit that wrote it */
+static void blame_report(OmiRepo *repo, const BlameLines *lines, const int *origin, OmiBlameFn fn, void *ctx) {
+    char message[MAX_LINE] = "";
+    char datetime[64] = "";
+    char user[MAX_SMALL] = "";
+    OmiCommit c;
+    size_t i;
+
+    c.id = 0;
+    c.message = message;
+    c.datetime = datetime;
+    c.user = user;
+    for (i = 0; i < lines->count; ++i) {
+        if (origin[i] != c.id) {
+            sqlite3_stmt *stmt = repo_stmt(repo, STMT_COMMIT_BY_ID);
+
+            message[0] = datetime[0] = user[0] = '\0';
+            if (stmt) {
+                sqlite3_bind_int(stmt, 1, origin[i]);
+                if (sqlite3_step(stmt) == SQLITE_ROW) {
+                    copy_text(message, sizeof(message), sqlite3_column_text(stmt, 1));
+                    copy_text(datetime, sizeof(datetime), sqlite3_column_text(stmt, 2));
+                    copy_text(user, sizeof(user), sqlite3_column_text(stmt, 3));
+                }
+                sqlite3_reset(stmt);
+            }
+            c.id = origin[i];
+        }
+        if (!fn(ctx, (long)i + 1, &c, (const char *)lines->text[i], lines->len[i])) break;
+    }
+}
+
+int omi_blame(OmiRepo *repo, const char *path, int commit_id, OmiBlameFn fn, void *ctx) {
+    PathVersion *versions = NULL;
+    size_t count = 0;
+    size_t start = 0;
+    u8 *cached = NULL;
+    size_t cached_len = 0;
+    int from_cache;
+    u8 *data = NULL;
+    size_t len = 0;
+    BlameLines lines;
+    int *origin = NULL;
+    int ok = 1;
+    size_t i;
+
+    memset(&lines, 0, sizeof(lines));
+    if (!batch_flush(repo)) return 0;
+    if (commit_id <= 0) commit_id = latest_commit_id(repo);
+    if (!blame_versions(repo, path, commit_id, &versions, &count)) return 0;
+    if (count == 0) {
+        free(versions);
+        return repo_error(repo, "%s not found in commit %d", path, commit_id);
+    }
+
+    /* Start from the newest cached version, or from the first version with
+     * every line written by its commit */
+    from_cache = blame_cached(repo, path, commit_id, versions, count, &start, &cached, &cached_len);
+    for (;;) {
+        if (!load_blob(repo, versions[start].hash, &data, &len)) {
+            ok = repo_error(repo, "Content of %s is not available", path);
+            break;
+        }
+        if (!blame_lines_split(data, len, &lines)
+            || (origin = (int *)malloc((lines.count + 1) * sizeof(int))) == NULL) {
+            ok = repo_error(repo, "Out of memory");
+            break;
+        }
+        if (from_cache && blame_decode(cached, cached_len, origin, lines.count)) break;
+        if (!from_cache) {
+            for (i = 0; i < lines.count; ++i) origin[i] = versions[start].commit_id;
+            break;
+        }
+        /* Cache entry does not match the blob: recompute from the start */
+        from_cache = 0;
+        start = 0;
+        free(origin);
+        origin = NULL;
+        blame_lines_free(&lines);
+        free(data);
+        data = NULL;
+    }
+    free(cached);
+
+    for (i = start + 1; ok && i < count; ++i) {
+        u8 *next_data = NULL;
+        size_t next_len = 0;
+        BlameLines next;
+        int *next_origin;
+
+        if (memcmp(versions[i].hash, versions[i - 1].hash, OMI_HASH_LEN) == 0) continue;
+        if (!load_blob(repo, versions[i].hash, &next_data, &next_len)) {
+            ok = repo_error(repo, "Content of %s is not available", path);
+            break;
+        }
+        if (!blame_lines_split(next_data, next_len, &next)
+            || (next_origin = (int *)malloc((next.count + 1) * sizeof(int))) == NULL) {
+            blame_lines_free(&next);
+            free(next_data);
+            ok = repo_error(repo, "Out of memory");
+            break;
+        }
+        if (!blame_diff(&lines, origin, &next, next_origin, versions[i].commit_id)) {
+            omi_info("Note: %s: commit %d needs over %ld line edits; all its changed lines are credited to it\n",
+                     path, versions[i].commit_id, OMI_BLAME_MAX_EDIT);
+        }
+        blame_lines_free(&lines);
+        free(origin);
+        free(data);
+        lines = next;
+        origin = next_origin;
+        data = next_data;
+        if ((i - start) % OMI_BLAME_CHECKPOINT == 0 && i != count - 1) {
+            blame_store(repo, &versions[i], origin, lines.count);
+        }
+    }
+
+    if (ok) {
+        if (start != count - 1) blame_store(repo, &versions[count - 1], origin, lines.count);
+        blame_report(repo, &lines, origin, fn, ctx);
+    }
+    blame_lines_free(&lines);
+    free(origin);
+    free(data);
+    free(versions);
+    return ok;
+}
+
+static int should_skip_file(const char *path) {
+    const char *base = basename_simple(path);
+    if (strcmp(base, ".omi") == 0) return 1;
+    if (strstr(base, ".omi") != NULL) return 1;
+    return 0;
+}
+
+#ifdef OMI_WINDOWS
+static void collect_files_windows(const char *root, PathList *out) {
+    WIN32_FIND_DATAA ffd;
+    HANDLE hFind;
+    char search[MAX_PATH_LEN];
+
+    snprintf(search, sizeof(search), "%s\\*", root);
+    hFind = FindFirstFileA(search, &ffd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+
+    do {
+        if (strcmp(ffd.cFileName, ".") == 0 || strcmp(ffd.cFileName, "..") == 0) {
+            continue;
+        }
+
+        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            char sub[MAX_PATH_LEN];
+            snprintf(sub, sizeof(sub), "%s\\%s", root, ffd.cFileName);
+            collect_files_windows(sub, out);
+        } else {
+            char file_path[MAX_PATH_LEN];
+            snprintf(file_path, sizeof(file_path), "%s\\%s", root, ffd.cFileName);
+            if (!should_skip_file(file_path)) {
+                path_list_push(out, file_path);
+            }
+        }
+    } while (FindNextFileA(hFind, &ffd) != 0);
+
+    FindClose(hFind);
+}
+#else
+static void collect_files_posix(const char *root, PathList *out) {
+    DIR *dir = opendir(root);
+    struct dirent *entry;
+
+    if (!dir) return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char path[MAX_PATH_LEN];
+        struct stat st;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", root, entry->d_name);
+        if (stat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                collect_files_posix(path, out);
+            } else {
+                if (!should_skip_file(path)) {
+                    path_list_push(out, path);
+                }
+            }
+        }
+    }
+
+    closedir(dir);
+}
+#endif
+
+int omi_add_all(OmiRepo *repo, const char *root) {
+    PathList paths;
+    Stager st;
+    int ok = 0;
+
+    memset(&paths, 0, sizeof(paths));
+#ifdef OMI_WINDOWS
+    collect_files_windows(root, &paths);
+#else
+    collect_files_posix(root, &paths);
+#endif
+    if (stager_open(&st, repo)) {
+        read_files(&paths, stage_data, &st);
+        ok = stager_close(&st);
+    }
+    path_list_free(&paths);
+    return ok;
+}
@@ -1,852 +1,525 @@
 /*
  * Omi - C89 CLI implementation
  * Cross-platform (AmigaOS, Windows, macOS, BSD, Linux)
+ * Command line front end for libomi (omi.h, libomi.c).
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <errno.h>
-
-#include <sqlite3.h>
-
-#if defined(_WIN32) || defined(_WIN64)
-#define OMI_WINDOWS 1
-#include <windows.h>
-#include <direct.h>
-#else
-#define OMI_POSIX 1
-#include <dirent.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#endif
-
-#ifdef AMIGA
-#define OMI_AMIGA 1
-#endif
-
-#ifdef USE_LIBCURL
-#include <curl/curl.h>
-#endif
-
-#define MAX_LINE 1024
-#define MAX_PATH_LEN 512
-#define MAX_SMALL 128
-
-typedef unsigned int u32;
-typedef unsigned char u8;
-
-typedef struct Settings {
-    char username[MAX_SMALL];
-    char password[MAX_SMALL];
-    char repos[MAX_PATH_LEN];
-    char curl[MAX_SMALL];
-    char api_enabled[MAX_SMALL];
-    int use_internal_http;
-    int http_timeout;
-} Settings;
-
-static void settings_init(Settings *s) {
-    memset(s, 0, sizeof(Settings));
-    strcpy(s->curl, "curl");
-    strcpy(s->api_enabled, "1");
-    s->use_internal_http = 1;
-    s->http_timeout = 30;
-}
-
-static void settings_load(Settings *s, const char *path) {
-    FILE *f = fopen(path, "r");
-    char line[MAX_LINE];
-
-    if (!f) {
-        return;
-    }
-
-    while (fgets(line, sizeof(line), f)) {
-        char *eq;
-        char *key;
-        char *value;
-
-        if (line[0] == '#') {
-            continue;
-        }
 
-        eq = strchr(line, '=');
-        if (!eq) {
-            continue;
-        }
+#include "omi.h"
 
-        *eq = '\0';
-        key = line;
-        value = eq + 1;
-
-        while (*value && (*value == ' ' || *value == '\t')) value++;
-        value[strcspn(value, "\r\n")] = '\0';
-
-        if (strcmp(key, "USERNAME") == 0) {
-            strncpy(s->username, value, MAX_SMALL - 1);
-        } else if (strcmp(key, "PASSWORD") == 0) {
-            strncpy(s->password, value, MAX_SMALL - 1);
-        } else if (strcmp(key, "REPOS") == 0) {
-            strncpy(s->repos, value, MAX_PATH_LEN - 1);
-        } else if (strcmp(key, "CURL") == 0) {
-            strncpy(s->curl, value, MAX_SMALL - 1);
-        } else if (strcmp(key, "API_ENABLED") == 0) {
-            strncpy(s->api_enabled, value, MAX_SMALL - 1);
-        } else if (strcmp(key, "USE_INTERNAL_HTTP") == 0) {
-            s->use_internal_http = (strcmp(value, "1") == 0);
-        } else if (strcmp(key, "HTTP_TIMEOUT") == 0) {
-            s->http_timeout = atoi(value);
-        }
-    }
+/* "1048576", "512k", "10m", "1g" */
+static long parse_size(const char *text) {
+    long value = atol(text);
+    const char *p = text;
 
-    fclose(f);
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == 'k' || *p == 'K') value *= 1024L;
+    else if (*p == 'm' || *p == 'M') value *= 1024L * 1024L;
+    else if (*p == 'g' || *p == 'G') value *= 1024L * 1024L * 1024L;
+    return value;
 }
 
-static int file_exists(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (f) {
-        fclose(f);
-        return 1;
-    }
-    return 0;
-}
+static int show_status(OmiRepo *repo, FILE *out) {
+    OmiIter *it = omi_staged(repo);
+    OmiFile f;
+    int ok;
 
-static void write_dotomi(const char *db_name) {
-    FILE *f = fopen(".omi", "w");
-    if (!f) return;
-    fprintf(f, "OMI_DB=\"%s\"\n", db_name);
-    fclose(f);
+    if (!it) return 0;
+    fprintf(out, "Staged files:\n");
+    while (omi_file_next(it, &f)) {
+        char hash_hex[OMI_HASH_LEN * 2 + 1];
+        omi_hash_hex(f.hash, hash_hex, sizeof(hash_hex));
+        hash_hex[12] = '\0';
+        fprintf(out, "  %-12s  %s\n", hash_hex, f.filename);
+    }
+    ok = !omi_iter_failed(it);
+    omi_iter_free(it);
+    return ok;
 }
 
-static void read_dotomi(char *out_db, size_t out_len) {
-    FILE *f = fopen(".omi", "r");
-    char line[MAX_LINE];
+static int show_log(OmiRepo *repo, FILE *out) {
+    OmiIter *it = omi_commits(repo);
+    OmiCommit c;
+    int ok;
 
-    if (!f) {
-        strncpy(out_db, "repo.omi", out_len - 1);
-        return;
+    while (omi_commit_next(it, &c)) {
+        fprintf(out, "[%d] %s (%s)\n", c.id, c.message, c.datetime);
     }
+    ok = !omi_iter_failed(it);
+    omi_iter_free(it);
+    return ok;
+}
 
-    while (fgets(line, sizeof(line), f)) {
-        char *start = strstr(line, "OMI_DB=\"");
-        if (start) {
-            start += strlen("OMI_DB=\"");
-            start[strcspn(start, "\"\r\n")] = '\0';
-            strncpy(out_db, start, out_len - 1);
-            fclose(f);
-            return;
-        }
-    }
+/* "   12 alice      2026-10-18    3) text" */
+static int show_blame_line(void *ctx, long line_no, const OmiCommit *origin, const char *text, size_t len) {
+    FILE *out = (FILE *)ctx;
 
-    fclose(f);
-    strncpy(out_db, "repo.omi", out_len - 1);
+    fprintf(out, "%5d %-10.10s %.10s %5ld) ", origin->id, origin->user, origin->datetime, line_no);
+    fwrite(text, 1, len, out);
+    fprintf(out, "\n");
+    return 1;
 }
 
-/* SHA256 implementation (C89) */
-
-typedef struct {
-    u32 state[8];
-    u32 bitlen[2];
-    u8 data[64];
-    u32 datalen;
-} SHA256_CTX;
-
-static u32 sha_rotr(u32 a, u32 b) { return ((a >> b) | (a << (32 - b))); }
-static u32 sha_ch(u32 x, u32 y, u32 z) { return (x & y) ^ (~x & z); }
-static u32 sha_maj(u32 x, u32 y, u32 z) { return (x & y) ^ (x & z) ^ (y & z); }
-static u32 sha_ep0(u32 x) { return sha_rotr(x, 2) ^ sha_rotr(x, 13) ^ sha_rotr(x, 22); }
-static u32 sha_ep1(u32 x) { return sha_rotr(x, 6) ^ sha_rotr(x, 11) ^ sha_rotr(x, 25); }
-static u32 sha_sig0(u32 x) { return sha_rotr(x, 7) ^ sha_rotr(x, 18) ^ (x >> 3); }
-static u32 sha_sig1(u32 x) { return sha_rotr(x, 17) ^ sha_rotr(x, 19) ^ (x >> 10); }
-
-static const u32 sha_k[64] = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
-    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
-    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
-    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
-    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
-    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
-    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
-    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
-    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-};
-
-static void sha256_transform(SHA256_CTX *ctx, const u8 data[]) {
-    u32 a, b, c, d, e, f, g, h, i, t1, t2, m[64];
-
-    for (i = 0; i < 16; ++i) {
-        m[i] = (data[i * 4] << 24) | (data[i * 4 + 1] << 16)
-             | (data[i * 4 + 2] << 8) | (data[i * 4 + 3]);
-    }
-    for (i = 16; i < 64; ++i) {
-        m[i] = sha_sig1(m[i - 2]) + m[i - 7] + sha_sig0(m[i - 15]) + m[i - 16];
-    }
-
-    a = ctx->state[0];
-    b = ctx->state[1];
-    c = ctx->state[2];
-    d = ctx->state[3];
-    e = ctx->state[4];
-    f = ctx->state[5];
-    g = ctx->state[6];
-    h = ctx->state[7];
-
-    for (i = 0; i < 64; ++i) {
-        t1 = h + sha_ep1(e) + sha_ch(e, f, g) + sha_k[i] + m[i];
-        t2 = sha_ep0(a) + sha_maj(a, b, c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t1;
-        d = c;
-        c = b;
-        b = a;
-        a = t1 + t2;
-    }
-
-    ctx->state[0] += a;
-    ctx->state[1] += b;
-    ctx->state[2] += c;
-    ctx->state[3] += d;
-    ctx->state[4] += e;
-    ctx->state[5] += f;
-    ctx->state[6] += g;
-    ctx->state[7] += h;
-}
+static int latest_commit(OmiRepo *repo) {
+    OmiIter *it = omi_commits(repo);
+    OmiCommit c;
+    int id = 0;
 
-static void sha256_init(SHA256_CTX *ctx) {
-    ctx->datalen = 0;
-    ctx->bitlen[0] = 0;
-    ctx->bitlen[1] = 0;
-    ctx->state[0] = 0x6a09e667;
-    ctx->state[1] = 0xbb67ae85;
-    ctx->state[2] = 0x3c6ef372;
-    ctx->state[3] = 0xa54ff53a;
-    ctx->state[4] = 0x510e527f;
-    ctx->state[5] = 0x9b05688c;
-    ctx->state[6] = 0x1f83d9ab;
-    ctx->state[7] = 0x5be0cd19;
+    if (omi_commit_next(it, &c)) id = c.id;
+    omi_iter_free(it);
+    return id;
 }
 
-static void sha256_update(SHA256_CTX *ctx, const u8 data[], size_t len) {
-    size_t i;
-    for (i = 0; i < len; ++i) {
-        ctx->data[ctx->datalen] = data[i];
-        ctx->datalen++;
-        if (ctx->datalen == 64) {
-            sha256_transform(ctx, ctx->data);
-            if (ctx->bitlen[0] > 0xffffffff - 512) {
-                ctx->bitlen[1]++;
-            }
-            ctx->bitlen[0] += 512;
-            ctx->datalen = 0;
-        }
-    }
-}
+/* 1536 -> "1.5 KB"; out must hold 32 bytes */
+static const char *human_size(double bytes, char *out) {
+    const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    int unit = 0;
 
-static void sha256_final(SHA256_CTX *ctx, u8 hash[]) {
-    u32 i = ctx->datalen;
-    u32 bitlen_low;
-    u32 bitlen_high;
-
-    if (ctx->datalen < 56) {
-        ctx->data[i++] = 0x80;
-        while (i < 56) ctx->data[i++] = 0x00;
-    } else {
-        ctx->data[i++] = 0x80;
-        while (i < 64) ctx->data[i++] = 0x00;
-        sha256_transform(ctx, ctx->data);
-        memset(ctx->data, 0, 56);
-    }
-
-    bitlen_high = ctx->bitlen[1];
-    bitlen_low = ctx->bitlen[0] + ctx->datalen * 8;
-
-    ctx->data[63] = (u8)(bitlen_low);
-    ctx->data[62] = (u8)(bitlen_low >> 8);
-    ctx->data[61] = (u8)(bitlen_low >> 16);
-    ctx->data[60] = (u8)(bitlen_low >> 24);
-    ctx->data[59] = (u8)(bitlen_high);
-    ctx->data[58] = (u8)(bitlen_high >> 8);
-    ctx->data[57] = (u8)(bitlen_high >> 16);
-    ctx->data[56] = (u8)(bitlen_high >> 24);
-
-    sha256_transform(ctx, ctx->data);
-
-    for (i = 0; i < 4; ++i) {
-        hash[i]      = (u8)((ctx->state[0] >> (24 - i * 8)) & 0xff);
-        hash[i + 4]  = (u8)((ctx->state[1] >> (24 - i * 8)) & 0xff);
-        hash[i + 8]  = (u8)((ctx->state[2] >> (24 - i * 8)) & 0xff);
-        hash[i + 12] = (u8)((ctx->state[3] >> (24 - i * 8)) & 0xff);
-        hash[i + 16] = (u8)((ctx->state[4] >> (24 - i * 8)) & 0xff);
-        hash[i + 20] = (u8)((ctx->state[5] >> (24 - i * 8)) & 0xff);
-        hash[i + 24] = (u8)((ctx->state[6] >> (24 - i * 8)) & 0xff);
-        hash[i + 28] = (u8)((ctx->state[7] >> (24 - i * 8)) & 0xff);
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        unit++;
     }
+    if (unit == 0) sprintf(out, "%.0f B", bytes);
+    else sprintf(out, "%.1f %s", bytes, units[unit]);
+    return out;
 }
 
-static void sha256_hex(const u8 *data, size_t len, char *out_hex, size_t out_len) {
-    u8 hash[32];
-    SHA256_CTX ctx;
-    size_t i;
-    const char *hex = "0123456789abcdef";
+/* Smallest size in histogram bucket i */
+static double bucket_floor(int i) {
+    double size = (i > 0) ? 1.0 : 0.0;
 
-    if (out_len < 65) return;
+    while (--i > 0) size *= 2.0;
+    return size;
+}
 
-    sha256_init(&ctx);
-    sha256_update(&ctx, data, len);
-    sha256_final(&ctx, hash);
+static void json_string(FILE *out, const char *text) {
+    const unsigned char *p = (const unsigned char *)text;
 
-    for (i = 0; i < 32; ++i) {
-        out_hex[i * 2] = hex[(hash[i] >> 4) & 0x0f];
-        out_hex[i * 2 + 1] = hex[hash[i] & 0x0f];
+    putc('"', out);
+    for (; *p; ++p) {
+        if (*p == '"' || *p == '\\') fprintf(out, "\\%c", *p);
+        else if (*p == '\n') fprintf(out, "\\n");
+        else if (*p == '\t') fprintf(out, "\\t");
+        else if (*p < 0x20) fprintf(out, "\\u%04x", *p);
+        else putc(*p, out);
     }
-    out_hex[64] = '\0';
+    putc('"', out);
 }
 
-static int load_file(const char *path, u8 **out_data, size_t *out_len) {
-    FILE *f = fopen(path, "rb");
-    long len;
-    u8 *data;
-
-    if (!f) return 0;
+static void show_stats_text(const OmiStats *st, FILE *out) {
+    char a[32];
+    char b[32];
+    char hex[OMI_HASH_LEN * 2 + 1];
+    int i;
 
-    fseek(f, 0, SEEK_END);
-    len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    if (len <= 0) {
-        fclose(f);
-        return 0;
+    fprintf(out, "Commits:         %ld\n", st->commits);
+    fprintf(out, "File versions:   %ld\n", st->file_versions);
+    fprintf(out, "Blobs:           %ld (%ld unreferenced)\n", st->blobs, st->unreferenced);
+    fprintf(out, "Logical size:    %s\n", human_size(st->logical_bytes, a));
+    fprintf(out, "Stored size:     %s\n", human_size(st->stored_bytes, a));
+    fprintf(out, "Dedup ratio:     %.2f\n", st->dedup_ratio);
+    if (st->delta_blobs > 0) {
+        fprintf(out, "Deltas:          %ld blobs in %s\n", st->delta_blobs, human_size(st->delta_bytes, a));
+        fprintf(out, "Delta savings:   %s\n", human_size(st->delta_saved, a));
     }
-
-    data = (u8 *)malloc((size_t)len);
-    if (!data) {
-        fclose(f);
-        return 0;
+    if (st->promised > 0) {
+        fprintf(out, "Promised:        %ld blobs, %s on server\n", st->promised, human_size(st->promised_bytes, a));
     }
 
-    if (fread(data, 1, (size_t)len, f) != (size_t)len) {
-        free(data);
-        fclose(f);
-        return 0;
+    fprintf(out, "\nBlob sizes:\n");
+    for (i = 0; i < OMI_STATS_BUCKETS; ++i) {
+        if (st->histogram_count[i] == 0) continue;
+        human_size(bucket_floor(i), a);
+        fprintf(out, "  >= %-10s %8ld  %s\n", a, st->histogram_count[i], human_size(st->histogram_bytes[i], b));
     }
 
-    fclose(f);
-    *out_data = data;
-    *out_len = (size_t)len;
-    return 1;
-}
-
-static int has_2fa_enabled(const Settings *s) {
-    FILE *f = fopen("users.txt", "r");
-    char line[MAX_LINE];
-    size_t user_len;
-
-    if (!f) return 0;
-
-    user_len = strlen(s->username);
-    while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, s->username, user_len) == 0 && line[user_len] == ':') {
-            char *p = strchr(line, ':');
-            if (!p) continue;
-            p = strchr(p + 1, ':');
-            if (p && *(p + 1) != '\n' && *(p + 1) != '\r' && *(p + 1) != '\0') {
-                fclose(f);
-                return 1;
-            }
-        }
+    fprintf(out, "\nLargest blobs:\n");
+    for (i = 0; i < st->largest_blob_count; ++i) {
+        omi_hash_hex(st->largest_blobs[i].hash, hex, sizeof(hex));
+        hex[12] = '\0';
+        fprintf(out, "  %-12s  %10s  x%-4ld %s\n", hex, human_size(st->largest_blobs[i].size, a),
+               st->largest_blobs[i].refs, st->largest_blobs[i].path);
     }
 
-    fclose(f);
-    return 0;
-}
-
-static void prompt_otp(char *out, size_t out_len) {
-    printf("Enter OTP code (6 digits): ");
-    if (fgets(out, (int)out_len, stdin)) {
-        out[strcspn(out, "\r\n")] = '\0';
+    fprintf(out, "\nLargest paths (all versions):\n");
+    for (i = 0; i < st->largest_path_count; ++i) {
+        fprintf(out, "  %10s  %4ld versions  %s\n", human_size(st->largest_paths[i].bytes, a),
+               st->largest_paths[i].versions, st->largest_paths[i].path);
     }
-}
 
-static const char *basename_simple(const char *path) {
-    const char *p = strrchr(path, '/');
-#if defined(_WIN32) || defined(_WIN64)
-    const char *p2 = strrchr(path, '\\');
-    if (!p || (p2 && p2 > p)) p = p2;
-#endif
-    return p ? p + 1 : path;
-}
-
-static int init_db(const char *db_name) {
-    sqlite3 *db;
-    char *err = NULL;
-    const char *sql =
-        "CREATE TABLE IF NOT EXISTS blobs (hash TEXT PRIMARY KEY, data BLOB, size INTEGER);"
-        "CREATE TABLE IF NOT EXISTS files (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash TEXT, datetime TEXT, commit_id INTEGER);"
-        "CREATE TABLE IF NOT EXISTS commits (id INTEGER PRIMARY KEY AUTOINCREMENT, message TEXT, datetime TEXT, user TEXT);"
-        "CREATE TABLE IF NOT EXISTS staging (id INTEGER PRIMARY KEY AUTOINCREMENT, filename TEXT, hash TEXT, datetime TEXT);";
-
-    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
-        fprintf(stderr, "Error: Unable to open database %s\n", db_name);
-        return 0;
+    fprintf(out, "\nGrowth per commit (new blobs):\n");
+    for (i = 0; i < st->commit_growth_count; ++i) {
+        const OmiStatsGrowth *g = &st->commit_growth[i];
+        fprintf(out, "  [%d] %10s  %6ld blobs  %s (%s)\n", g->commit_id, human_size(g->bytes, a), g->blobs, g->user, g->datetime);
     }
 
-    if (sqlite3_exec(db, sql, 0, 0, &err) != SQLITE_OK) {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_close(db);
-        return 0;
+    fprintf(out, "\nGrowth per user:\n");
+    for (i = 0; i < st->user_growth_count; ++i) {
+        const OmiStatsGrowth *g = &st->user_growth[i];
+        fprintf(out, "  %10s  %6ld blobs  %4ld commits  %s\n", human_size(g->bytes, a), g->blobs, g->commits, g->user);
     }
 
-    sqlite3_close(db);
-    return 1;
-}
-
-static int add_file_to_db(const char *db_name, const char *filename) {
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-    u8 *data = NULL;
-    size_t data_len = 0;
-    char hash_hex[65];
-    time_t now = time(NULL);
-    char dt[64];
-
-    if (!load_file(filename, &data, &data_len)) {
-        fprintf(stderr, "Error: Cannot read file %s\n", filename);
-        return 0;
-    }
-
-    sha256_hex(data, data_len, hash_hex, sizeof(hash_hex));
-    strftime(dt, sizeof(dt), "%Y-%m-%d %H:%M:%S", gmtime(&now));
-
-    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
-        fprintf(stderr, "Error: Unable to open database %s\n", db_name);
-        free(data);
-        return 0;
+    fprintf(out, "\nPages: %ld x %ld bytes, %ld free (%.1f%%)\n", st->page_count, st->page_size, st->freelist_count,
+           st->page_count > 0 ? 100.0 * st->freelist_count / st->page_count : 0.0);
+    for (i = 0; i < st->table_count; ++i) {
+        const OmiStatsTable *t = &st->tables[i];
+        fprintf(out, "  %-20s %8ld pages  %10s  %.1f%% used\n", t->name, t->pages, human_size(t->bytes, a),
+               t->bytes > 0 ? 100.0 * (t->bytes - t->unused) / t->bytes : 0.0);
     }
-
-    /* Insert blob if missing */
-    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO blobs (hash, data, size) VALUES (?, ?, ?)", -1, &stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, hash_hex, -1, SQLITE_STATIC);
-        sqlite3_bind_blob(stmt, 2, data, (int)data_len, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 3, (int)data_len);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-    }
-
-    /* Stage file */
-    if (sqlite3_prepare_v2(db, "INSERT INTO staging (filename, hash, datetime) VALUES (?, ?, ?)", -1, &stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, hash_hex, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, dt, -1, SQLITE_STATIC);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+    if (!st->pages_exact) {
+        fprintf(out, "  (per-table pages skipped; use --full)\n");
     }
-
-    sqlite3_close(db);
-    free(data);
-    return 1;
 }
 
-static int commit_files(const char *db_name, const Settings *s, const char *message) {
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-    int commit_id = 0;
-    time_t now = time(NULL);
-    char dt[64];
+static void show_stats_json(const OmiStats *st, FILE *out) {
+    char hex[OMI_HASH_LEN * 2 + 1];
+    const char *sep = "";
+    int i;
 
-    strftime(dt, sizeof(dt), "%Y-%m-%d %H:%M:%S", gmtime(&now));
+    fprintf(out, "{\"commits\":%ld,\"file_versions\":%ld,\"blobs\":%ld,\"unreferenced_blobs\":%ld,",
+           st->commits, st->file_versions, st->blobs, st->unreferenced);
+    fprintf(out, "\"logical_bytes\":%.0f,\"stored_bytes\":%.0f,\"dedup_ratio\":%.4f,",
+           st->logical_bytes, st->stored_bytes, st->dedup_ratio);
+    fprintf(out, "\"promised_blobs\":%ld,\"promised_bytes\":%.0f,", st->promised, st->promised_bytes);
+    fprintf(out, "\"delta_blobs\":%ld,\"delta_bytes\":%.0f,\"delta_saved_bytes\":%.0f,",
+           st->delta_blobs, st->delta_bytes, st->delta_saved);
 
-    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
-        fprintf(stderr, "Error: Unable to open database %s\n", db_name);
-        return 0;
+    fprintf(out, "\"histogram\":[");
+    for (i = 0; i < OMI_STATS_BUCKETS; ++i) {
+        if (st->histogram_count[i] == 0) continue;
+        fprintf(out, "%s{\"min_size\":%.0f,\"blobs\":%ld,\"bytes\":%.0f}", sep,
+               bucket_floor(i), st->histogram_count[i], st->histogram_bytes[i]);
+        sep = ",";
     }
+    fprintf(out, "],");
 
-    if (sqlite3_prepare_v2(db, "INSERT INTO commits (message, datetime, user) VALUES (?, ?, ?)", -1, &stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, message, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, dt, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, s->username, -1, SQLITE_STATIC);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+    fprintf(out, "\"largest_blobs\":[");
+    for (i = 0; i < st->largest_blob_count; ++i) {
+        omi_hash_hex(st->largest_blobs[i].hash, hex, sizeof(hex));
+        fprintf(out, "%s{\"hash\":\"%s\",\"size\":%.0f,\"refs\":%ld,\"path\":", i ? "," : "", hex,
+               st->largest_blobs[i].size, st->largest_blobs[i].refs);
+        json_string(out, st->largest_blobs[i].path);
+        fprintf(out, "}");
     }
+    fprintf(out, "],");
 
-    commit_id = (int)sqlite3_last_insert_rowid(db);
-
-    if (sqlite3_prepare_v2(db, "SELECT filename, hash, datetime FROM staging", -1, &stmt, 0) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *filename = (const char *)sqlite3_column_text(stmt, 0);
-            const char *hash = (const char *)sqlite3_column_text(stmt, 1);
-            const char *dt_stage = (const char *)sqlite3_column_text(stmt, 2);
-
-            sqlite3_stmt *stmt2;
-            if (sqlite3_prepare_v2(db, "INSERT INTO files (filename, hash, datetime, commit_id) VALUES (?, ?, ?, ?)", -1, &stmt2, 0) == SQLITE_OK) {
-                sqlite3_bind_text(stmt2, 1, filename, -1, SQLITE_STATIC);
-                sqlite3_bind_text(stmt2, 2, hash, -1, SQLITE_STATIC);
-                sqlite3_bind_text(stmt2, 3, dt_stage, -1, SQLITE_STATIC);
-                sqlite3_bind_int(stmt2, 4, commit_id);
-                sqlite3_step(stmt2);
-                sqlite3_finalize(stmt2);
-            }
-        }
-        sqlite3_finalize(stmt);
+    fprintf(out, "\"largest_paths\":[");
+    for (i = 0; i < st->largest_path_count; ++i) {
+        fprintf(out, "%s{\"path\":", i ? "," : "");
+        json_string(out, st->largest_paths[i].path);
+        fprintf(out, ",\"versions\":%ld,\"bytes\":%.0f}", st->largest_paths[i].versions, st->largest_paths[i].bytes);
     }
+    fprintf(out, "],");
 
-    sqlite3_exec(db, "DELETE FROM staging", 0, 0, 0);
-    sqlite3_close(db);
-
-    printf("Committed: %d\n", commit_id);
-    return 1;
-}
-
-static void show_status(const char *db_name) {
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-
-    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
-        fprintf(stderr, "Error: Unable to open database %s\n", db_name);
-        return;
+    fprintf(out, "\"commit_growth\":[");
+    for (i = 0; i < st->commit_growth_count; ++i) {
+        const OmiStatsGrowth *g = &st->commit_growth[i];
+        fprintf(out, "%s{\"commit\":%d,\"user\":", i ? "," : "", g->commit_id);
+        json_string(out, g->user);
+        fprintf(out, ",\"datetime\":");
+        json_string(out, g->datetime);
+        fprintf(out, ",\"new_blobs\":%ld,\"new_bytes\":%.0f}", g->blobs, g->bytes);
     }
+    fprintf(out, "],");
 
-    printf("Staged files:\n");
-    if (sqlite3_prepare_v2(db, "SELECT filename FROM staging", -1, &stmt, 0) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *filename = (const char *)sqlite3_column_text(stmt, 0);
-            printf("  %s\n", filename);
-        }
-        sqlite3_finalize(stmt);
+    fprintf(out, "\"user_growth\":[");
+    for (i = 0; i < st->user_growth_count; ++i) {
+        const OmiStatsGrowth *g = &st->user_growth[i];
+        fprintf(out, "%s{\"user\":", i ? "," : "");
+        json_string(out, g->user);
+        fprintf(out, ",\"commits\":%ld,\"new_blobs\":%ld,\"new_bytes\":%.0f,\"last_commit\":%d}",
+               g->commits, g->blobs, g->bytes, g->commit_id);
     }
+    fprintf(out, "],");
 
-    sqlite3_close(db);
+    fprintf(out, "\"pages\":{\"page_size\":%ld,\"page_count\":%ld,\"freelist_count\":%ld,\"exact\":%s,\"tables\":[",
+           st->page_size, st->page_count, st->freelist_count, st->pages_exact ? "true" : "false");
+    for (i = 0; i < st->table_count; ++i) {
+        const OmiStatsTable *t = &st->tables[i];
+        fprintf(out, "%s{\"name\":", i ? "," : "");
+        json_string(out, t->name);
+        fprintf(out, ",\"pages\":%ld,\"bytes\":%.0f,\"unused\":%.0f}", t->pages, t->bytes, t->unused);
+    }
+    fprintf(out, "]}}\n");
 }
 
-static void show_log(const char *db_name) {
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
+static void print_help(void) {
+    printf("Omi - C89 CLI\n\n");
+    printf("Usage: omi <command> [options]\n\n");
+    printf("Commands:\n");
+    printf("  init [db]         Initialize repository\n");
+    printf("    --format=2                  Binary hash keys (C89 CLI only, see migrate)\n");
+    printf("  add <file>        Stage file\n");
+    printf("  add --all         Stage all files\n");
+    printf("  commit -m <msg>   Commit staged files\n");
+    printf("  push [db ...]     Push to server\n");
+    printf("  pull [db ...]     Pull from server\n");
+    printf("    --filter=blob:limit=<size>  Partial clone: leave larger blobs on server\n");
+    printf("    --filter=path:<glob>        Partial clone: always fetch matching paths\n");
+    printf("  fetch             Fetch all blobs missing from a partial clone\n");
+    printf("  checkout [commit] Write the files of a commit (default: latest)\n");
+    printf("  cat <file> [commit]  Print a file as of a commit\n");
+    printf("  blame <file> [commit]  Show the commit that wrote each line\n");
+    printf("  log               Show commit log\n");
+    printf("  status            Show staging status\n");
+    printf("  stats [--json]    Show repository size statistics\n");
+    printf("    --limit=N                   Entries per list (default 10)\n");
+    printf("    --full                      Per-table page usage even on large repositories\n");
+    printf("  batch [-z]        Run commands from stdin, one per line (-z: NUL-terminated)\n");
+    printf("  migrate           Convert repository to binary hash keys (format 2)\n");
+    printf("\n");
+}
 
-    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
-        fprintf(stderr, "Error: Unable to open database %s\n", db_name);
-        return;
+/* Usage text when argv lacks a command's required arguments, else NULL */
+static const char *repo_command_usage(int argc, char **argv) {
+    if (strcmp(argv[1], "add") == 0 && argc < 3) {
+        return "omi add <file> | omi add --all";
     }
-
-    if (sqlite3_prepare_v2(db, "SELECT id, message, datetime FROM commits ORDER BY id DESC", -1, &stmt, 0) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            const char *msg = (const char *)sqlite3_column_text(stmt, 1);
-            const char *dt = (const char *)sqlite3_column_text(stmt, 2);
-            printf("[%d] %s (%s)\n", id, msg, dt);
-        }
-        sqlite3_finalize(stmt);
+    if (strcmp(argv[1], "commit") == 0 && (argc < 4 || strcmp(argv[2], "-m") != 0)) {
+        return "omi commit -m \"message\"";
     }
-
-    sqlite3_close(db);
-}
-
-static int use_internal_http(const Settings *s) {
-#ifdef USE_LIBCURL
-    if (s->use_internal_http) {
-        return 1;
+    if (strcmp(argv[1], "cat") == 0 && argc < 3) {
+        return "omi cat <file> [commit]";
     }
-#else
-    (void)s;
-#endif
-    return 0;
-}
-
-#ifdef USE_LIBCURL
-static size_t write_file_cb(void *ptr, size_t size, size_t nmemb, void *stream) {
-    FILE *f = (FILE *)stream;
-    return fwrite(ptr, size, nmemb, f);
-}
-#endif
-
-static int push_with_libcurl(const Settings *s, const char *db_name, const char *otp_code) {
-#ifdef USE_LIBCURL
-    CURL *curl;
-    CURLcode res;
-    struct curl_httppost *form = NULL;
-    struct curl_httppost *last = NULL;
-    char url[MAX_PATH_LEN];
-
-    snprintf(url, sizeof(url), "%s/", s->repos);
-
-    curl = curl_easy_init();
-    if (!curl) return 0;
-
-    curl_formadd(&form, &last, CURLFORM_COPYNAME, "username", CURLFORM_COPYCONTENTS, s->username, CURLFORM_END);
-    curl_formadd(&form, &last, CURLFORM_COPYNAME, "password", CURLFORM_COPYCONTENTS, s->password, CURLFORM_END);
-    curl_formadd(&form, &last, CURLFORM_COPYNAME, "repo_name", CURLFORM_COPYCONTENTS, basename_simple(db_name), CURLFORM_END);
-    curl_formadd(&form, &last, CURLFORM_COPYNAME, "repo_file", CURLFORM_FILE, db_name, CURLFORM_END);
-    curl_formadd(&form, &last, CURLFORM_COPYNAME, "action", CURLFORM_COPYCONTENTS, "Upload", CURLFORM_END);
-    if (otp_code && otp_code[0]) {
-        curl_formadd(&form, &last, CURLFORM_COPYNAME, "otp_code", CURLFORM_COPYCONTENTS, otp_code, CURLFORM_END);
-    }
-
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_HTTPPOST, form);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)s->http_timeout);
-
-    res = curl_easy_perform(curl);
-    curl_formfree(form);
-    curl_easy_cleanup(curl);
-
-    return (res == CURLE_OK);
-#else
-    (void)s;
-    (void)db_name;
-    (void)otp_code;
-    return 0;
-#endif
-}
-
-static int pull_with_libcurl(const Settings *s, const char *db_name, const char *otp_code) {
-#ifdef USE_LIBCURL
-    CURL *curl;
-    CURLcode res;
-    FILE *f = NULL;
-    char url[MAX_PATH_LEN];
-    char post_fields[MAX_LINE];
-
-    snprintf(url, sizeof(url), "%s/", s->repos);
-
-    snprintf(post_fields, sizeof(post_fields),
-        "username=%s&password=%s&repo_name=%s&action=pull%s%s",
-        s->username, s->password, basename_simple(db_name),
-        (otp_code && otp_code[0]) ? "&otp_code=" : "",
-        (otp_code && otp_code[0]) ? otp_code : "");
-
-    curl = curl_easy_init();
-    if (!curl) return 0;
-
-    f = fopen(db_name, "wb");
-    if (!f) {
-        curl_easy_cleanup(curl);
-        return 0;
+    if (strcmp(argv[1], "blame") == 0 && argc < 3) {
+        return "omi blame <file> [commit]";
     }
-
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)s->http_timeout);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
-
-    res = curl_easy_perform(curl);
-    fclose(f);
-    curl_easy_cleanup(curl);
-
-    return (res == CURLE_OK);
-#else
-    (void)s;
-    (void)db_name;
-    (void)otp_code;
-    return 0;
-#endif
+    return NULL;
 }
 
-static int push_with_curl_exec(const Settings *s, const char *db_name, const char *otp_code) {
-    char cmd[2048];
-    char otp_part[256] = "";
-
-    if (otp_code && otp_code[0]) {
-        snprintf(otp_part, sizeof(otp_part), " -F \"otp_code=%s\"", otp_code);
-    }
-
-    snprintf(cmd, sizeof(cmd),
-        "%s -f -X POST -F \"username=%s\" -F \"password=%s\" -F \"repo_name=%s\" -F \"repo_file=@%s\" -F \"action=Upload\"%s \"%s/\"",
-        s->curl, s->username, s->password, basename_simple(db_name), db_name, otp_part, s->repos);
-
-    return (system(cmd) == 0);
+static int is_repo_command(const char *name) {
+    return strcmp(name, "add") == 0 || strcmp(name, "commit") == 0
+        || strcmp(name, "fetch") == 0 || strcmp(name, "checkout") == 0
+        || strcmp(name, "cat") == 0 || strcmp(name, "status") == 0
+        || strcmp(name, "log") == 0 || strcmp(name, "stats") == 0
+        || strcmp(name, "blame") == 0;
 }
 
-static int pull_with_curl_exec(const Settings *s, const char *db_name, const char *otp_code) {
-    char cmd[2048];
-    char otp_part[256] = "";
-
-    if (otp_code && otp_code[0]) {
-        snprintf(otp_part, sizeof(otp_part), " -d \"otp_code=%s\"", otp_code);
-    }
-
-    snprintf(cmd, sizeof(cmd),
-        "%s -f -X POST -d \"username=%s\" -d \"password=%s\" -d \"repo_name=%s\" -d \"action=pull\"%s -o \"%s\" \"%s/\"",
-        s->curl, s->username, s->password, basename_simple(db_name), otp_part, db_name, s->repos);
-
-    return (system(cmd) == 0);
+/* Commands whose output is printed as data in batch mode */
+static int is_framed_command(const char *name) {
+    return strcmp(name, "cat") == 0 || strcmp(name, "blame") == 0
+        || strcmp(name, "status") == 0 || strcmp(name, "log") == 0
+        || strcmp(name, "stats") == 0;
 }
 
-static void push_repo(const Settings *s, const char *db_name) {
-    char otp_code[32] = "";
+/* Print a batch command's output as "data <n>", the n bytes and a newline,
+ * so that it cannot be mistaken for a result line */
+static void batch_data(FILE *tmp) {
+    char buf[8192];
+    size_t n;
 
-    if (strcmp(s->api_enabled, "0") == 0) {
-        printf("Error: API is disabled\n");
-        return;
-    }
-
-    if (!file_exists(db_name)) {
-        printf("Error: Database file %s not found\n", db_name);
-        return;
+    fflush(tmp);
+    printf("data %ld\n", ftell(tmp));
+    rewind(tmp);
+    while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0) {
+        fwrite(buf, 1, n, stdout);
     }
+    printf("\n");
+}
 
-    if (has_2fa_enabled(s)) {
-        prompt_otp(otp_code, sizeof(otp_code));
-    }
+/* Run one command on an open handle. In batch mode the values for the
+ * "ok <command> ..." result line go to result (64 bytes) instead of stdout,
+ * and the output of framed commands is printed through batch_data. */
+static int repo_command(OmiRepo *repo, int argc, char **argv, int batch, char *result) {
+    int out_framed = batch && is_framed_command(argv[1]);
+    FILE *out = out_framed ? tmpfile() : stdout;
+    int ok = 1;
 
-    if (use_internal_http(s)) {
-        if (!push_with_libcurl(s, db_name, otp_code)) {
-            printf("Internal HTTP failed, falling back to curl\n");
-            if (!push_with_curl_exec(s, db_name, otp_code)) {
-                printf("Error: Failed to push\n");
-            }
+    if (strcmp(argv[1], "add") == 0) {
+        if (strcmp(argv[2], "--all") == 0) {
+            ok = omi_add_all(repo, ".");
         } else {
-            printf("Successfully pushed to %s\n", s->repos);
+            ok = omi_add(repo, argv[2]);
         }
-    } else {
-        if (!push_with_curl_exec(s, db_name, otp_code)) {
-            printf("Error: Failed to push\n");
+    } else if (strcmp(argv[1], "commit") == 0) {
+        int commit_id = 0;
+        ok = omi_commit(repo, argv[3], &commit_id);
+        if (ok && batch) sprintf(result, " %d", commit_id);
+        else if (ok) printf("Committed: %d\n", commit_id);
+    } else if (strcmp(argv[1], "fetch") == 0) {
+        long fetched = 0;
+        ok = omi_fetch(repo, &fetched);
+        if (batch) sprintf(result, " %ld", fetched);
+        else printf("Fetched %ld blobs\n", fetched);
+    } else if (strcmp(argv[1], "checkout") == 0) {
+        int commit_id = (argc >= 3) ? atoi(argv[2]) : latest_commit(repo);
+        int written = 0;
+        int failed = 0;
+        ok = omi_checkout(repo, commit_id, &written, &failed);
+        if (batch) {
+            sprintf(result, " %d %d %d", commit_id, written, failed);
         } else {
-            printf("Successfully pushed to %s\n", s->repos);
+            printf("Checked out commit %d: %d files", commit_id, written);
+            if (failed > 0) printf(", %d failed", failed);
+            printf("\n");
+        }
+    } else if (strcmp(argv[1], "cat") == 0) {
+        int commit_id = (argc >= 4) ? atoi(argv[3]) : 0;
+        ok = out && omi_cat(repo, argv[2], commit_id, out);
+    } else if (strcmp(argv[1], "blame") == 0) {
+        ok = out && omi_blame(repo, argv[2], (argc >= 4) ? atoi(argv[3]) : 0, show_blame_line, out);
+    } else if (strcmp(argv[1], "status") == 0) {
+        ok = out && show_status(repo, out);
+    } else if (strcmp(argv[1], "log") == 0) {
+        ok = out && show_log(repo, out);
+    } else if (strcmp(argv[1], "stats") == 0) {
+        OmiStats *st = (OmiStats *)malloc(sizeof(OmiStats));
+        int json = 0;
+        int full = 0;
+        int limit = 10;
+        int i;
+
+        for (i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--json") == 0) json = 1;
+            else if (strcmp(argv[i], "--full") == 0) full = 1;
+            else if (strncmp(argv[i], "--limit=", 8) == 0) limit = atoi(argv[i] + 8);
         }
+        ok = out && st && omi_stats(repo, limit, full, st);
+        if (ok && json) show_stats_json(st, out);
+        else if (ok) show_stats_text(st, out);
+        free(st);
     }
-}
-
-static void pull_repo(const Settings *s, const char *db_name) {
-    char otp_code[32] = "";
-
-    if (strcmp(s->api_enabled, "0") == 0) {
-        printf("Error: API is disabled\n");
-        return;
+    if (out_framed && out) {
+        if (ok) batch_data(out);
+        fclose(out);
     }
+    return ok;
+}
 
-    if (has_2fa_enabled(s)) {
-        prompt_otp(otp_code, sizeof(otp_code));
-    }
+/* Commands that work on the repository in .omi through one handle */
+static int run_repo_command(const OmiSettings *settings, const char *db_name, int argc, char **argv) {
+    const char *usage = repo_command_usage(argc, argv);
+    OmiRepo *repo;
+    int ok;
 
-    if (use_internal_http(s)) {
-        if (!pull_with_libcurl(s, db_name, otp_code)) {
-            printf("Internal HTTP failed, falling back to curl\n");
-            if (!pull_with_curl_exec(s, db_name, otp_code)) {
-                printf("Error: Failed to pull\n");
-            }
-        } else {
-            printf("Successfully pulled from %s\n", s->repos);
-        }
-    } else {
-        if (!pull_with_curl_exec(s, db_name, otp_code)) {
-            printf("Error: Failed to pull\n");
-        } else {
-            printf("Successfully pulled from %s\n", s->repos);
-        }
+    if (usage) {
+        printf("Usage: %s\n", usage);
+        return 1;
     }
-}
 
-static int should_skip_file(const char *path) {
-    const char *base = basename_simple(path);
-    if (strcmp(base, ".omi") == 0) return 1;
-    if (strstr(base, ".omi") != NULL) return 1;
-    return 0;
+    repo = omi_repo_open(db_name, settings);
+    if (!repo) return 1;
+    ok = repo_command(repo, argc, argv, 0, NULL);
+    omi_close(repo);
+    return ok ? 0 : 1;
 }
 
-#ifdef OMI_WINDOWS
-static void add_all_files_windows(const char *root, const char *db_name) {
-    WIN32_FIND_DATAA ffd;
-    HANDLE hFind;
-    char search[MAX_PATH_LEN];
+#define BATCH_MAX_ARGS 64
 
-    snprintf(search, sizeof(search), "%s\\*", root);
-    hFind = FindFirstFileA(search, &ffd);
-    if (hFind == INVALID_HANDLE_VALUE) return;
+/* Read one command terminated by delim (or EOF) into *line, growing it */
+static int batch_read(FILE *in, int delim, char **line, size_t *cap) {
+    size_t len = 0;
+    int c;
 
-    do {
-        if (strcmp(ffd.cFileName, ".") == 0 || strcmp(ffd.cFileName, "..") == 0) {
-            continue;
-        }
-
-        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            char sub[MAX_PATH_LEN];
-            snprintf(sub, sizeof(sub), "%s\\%s", root, ffd.cFileName);
-            add_all_files_windows(sub, db_name);
-        } else {
-            char file_path[MAX_PATH_LEN];
-            snprintf(file_path, sizeof(file_path), "%s\\%s", root, ffd.cFileName);
-            if (!should_skip_file(file_path)) {
-                add_file_to_db(db_name, file_path);
-            }
+    while ((c = getc(in)) != EOF && c != delim) {
+        if (len + 1 >= *cap) {
+            size_t grown = *cap ? *cap * 2 : 256;
+            char *p = (char *)realloc(*line, grown);
+            if (!p) return 0;
+            *line = p;
+            *cap = grown;
         }
-    } while (FindNextFileA(hFind, &ffd) != 0);
-
-    FindClose(hFind);
+        (*line)[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) return 0;
+    if (delim == '\n' && len > 0 && (*line)[len - 1] == '\r') len--;
+    if (!*line) {
+        *line = (char *)malloc(1);
+        if (!*line) return 0;
+        *cap = 1;
+    }
+    (*line)[len] = '\0';
+    return 1;
 }
-#else
-static void add_all_files_posix(const char *root, const char *db_name) {
-    DIR *dir = opendir(root);
-    struct dirent *entry;
-
-    if (!dir) return;
 
-    while ((entry = readdir(dir)) != NULL) {
-        char path[MAX_PATH_LEN];
-        struct stat st;
-
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        snprintf(path, sizeof(path), "%s/%s", root, entry->d_name);
-        if (stat(path, &st) == 0) {
-            if (S_ISDIR(st.st_mode)) {
-                add_all_files_posix(path, db_name);
-            } else {
-                if (!should_skip_file(path)) {
-                    add_file_to_db(db_name, path);
+/* Split a command into words in place. Words are separated by spaces or
+ * tabs; "double quotes" keep spaces, with \" \\ \n and \t escapes inside. */
+static int batch_split(char *line, char **argv, int max_args) {
+    char *in = line;
+    char *out = line;
+    int argc = 1;
+
+    argv[0] = "omi";
+    for (;;) {
+        while (*in == ' ' || *in == '\t') in++;
+        if (*in == '\0' || argc >= max_args) break;
+        argv[argc++] = out;
+        while (*in && *in != ' ' && *in != '\t') {
+            if (*in != '"') {
+                *out++ = *in++;
+                continue;
+            }
+            for (in++; *in && *in != '"'; in++) {
+                if (*in == '\\' && in[1]) {
+                    in++;
+                    *out++ = (*in == 'n') ? '\n' : (*in == 't') ? '\t' : *in;
+                } else {
+                    *out++ = *in;
                 }
             }
+            if (*in == '"') in++;
+        }
+        if (*in) in++;
+        *out++ = '\0';
+    }
+    return argc;
+}
+
+/* omi batch: run commands from stdin over one handle, one result line each */
+static int run_batch(const OmiSettings *settings, const char *db_name, int delim) {
+    OmiRepo *repo;
+    char *line = NULL;
+    size_t cap = 0;
+    int failures = 0;
+
+    repo = omi_repo_open(db_name, settings);
+    if (!repo) return 1;
+    /* Library messages would interleave with the results */
+    omi_set_output(stderr, stderr);
+    omi_batch_begin(repo);
+
+    while (batch_read(stdin, delim, &line, &cap)) {
+        char *argv[BATCH_MAX_ARGS];
+        char result[64] = "";
+        const char *usage;
+        int argc = batch_split(line, argv, BATCH_MAX_ARGS);
+
+        if (argc < 2 || argv[1][0] == '#') continue;
+        if (!is_repo_command(argv[1])) {
+            printf("error %s unknown command\n", argv[1]);
+            failures++;
+        } else if ((usage = repo_command_usage(argc, argv)) != NULL) {
+            printf("error %s usage: %s\n", argv[1], usage);
+            failures++;
+        } else if (repo_command(repo, argc, argv, 1, result)) {
+            printf("ok %s%s\n", argv[1], result);
+        } else {
+            printf("error %s %s\n", argv[1], omi_errmsg(repo));
+            failures++;
         }
+        fflush(stdout);
     }
 
-    closedir(dir);
-}
-#endif
-
-static void add_all_files(const char *db_name) {
-#ifdef OMI_WINDOWS
-    add_all_files_windows(".", db_name);
-#else
-    add_all_files_posix(".", db_name);
-#endif
-}
-
-static void print_help(void) {
-    printf("Omi - C89 CLI\n\n");
-    printf("Usage: omi <command> [options]\n\n");
-    printf("Commands:\n");
-    printf("  init [db]         Initialize repository\n");
-    printf("  add <file>        Stage file\n");
-    printf("  add --all         Stage all files\n");
-    printf("  commit -m <msg>   Commit staged files\n");
-    printf("  push              Push to server\n");
-    printf("  pull              Pull from server\n");
-    printf("  log               Show commit log\n");
-    printf("  status            Show staging status\n");
-    printf("\n");
+    if (!omi_batch_end(repo)) {
+        printf("error batch %s\n", omi_errmsg(repo));
+        failures++;
+    }
+    free(line);
+    omi_close(repo);
+    return failures > 0 ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
-    Settings settings;
-    char db_name[MAX_PATH_LEN];
+    OmiSettings settings;
+    char db_name[OMI_MAX_PATH] = "";
 
-    settings_init(&settings);
-    settings_load(&settings, "../settings.txt");
+    omi_settings_init(&settings);
+    omi_settings_load(&settings, "../settings.txt");
 
-    read_dotomi(db_name, sizeof(db_name));
+    omi_read_dotomi(db_name, sizeof(db_name));
 
     if (argc < 2) {
         print_help();
@@ -854,54 +527,60 @@ int main(int argc, char **argv) {
     }
 
     if (strcmp(argv[1], "init") == 0) {
-        const char *db = (argc >= 3) ? argv[2] : "repo.omi";
-        write_dotomi(db);
-        if (init_db(db)) {
-            printf("Repository initialized\n");
-        }
-        return 0;
-    }
+        const char *db = "repo.omi";
+        int format = 1;
+        int i;
 
-    if (strcmp(argv[1], "add") == 0) {
-        if (argc < 3) {
-            printf("Usage: omi add <file> | omi add --all\n");
-            return 1;
-        }
-        if (strcmp(argv[2], "--all") == 0) {
-            add_all_files(db_name);
-        } else {
-            add_file_to_db(db_name, argv[2]);
+        for (i = 2; i < argc; ++i) {
+            if (strncmp(argv[i], "--format=", 9) == 0) format = atoi(argv[i] + 9);
+            else db = argv[i];
         }
-        return 0;
-    }
-
-    if (strcmp(argv[1], "commit") == 0) {
-        if (argc < 4 || strcmp(argv[2], "-m") != 0) {
-            printf("Usage: omi commit -m \"message\"\n");
-            return 1;
+        omi_write_dotomi(db);
+        if (omi_init_format(db, format)) {
+            printf("Repository initialized\n");
         }
-        commit_files(db_name, &settings, argv[3]);
         return 0;
     }
 
     if (strcmp(argv[1], "push") == 0) {
-        push_repo(&settings, db_name);
+        const char *default_db = db_name;
+        const char **names = (argc >= 3) ? (const char **)(argv + 2) : &default_db;
+        omi_push(&settings, names, (argc >= 3) ? argc - 2 : 1);
         return 0;
     }
 
     if (strcmp(argv[1], "pull") == 0) {
-        pull_repo(&settings, db_name);
+        const char *names[64];
+        OmiPullFilter filter;
+        int count = 0;
+        int i;
+
+        memset(&filter, 0, sizeof(filter));
+        for (i = 2; i < argc; ++i) {
+            if (strncmp(argv[i], "--filter=blob:limit=", 20) == 0) {
+                filter.blob_limit = parse_size(argv[i] + 20);
+            } else if (strncmp(argv[i], "--filter=path:", 14) == 0) {
+                filter.path_glob = argv[i] + 14;
+            } else if (count < 64) {
+                names[count++] = argv[i];
+            }
+        }
+        if (count == 0) names[count++] = db_name;
+        omi_pull(&settings, names, count, &filter);
         return 0;
     }
 
-    if (strcmp(argv[1], "status") == 0) {
-        show_status(db_name);
-        return 0;
+    if (strcmp(argv[1], "migrate") == 0) {
+        return omi_migrate(db_name) ? 0 : 1;
     }
 
-    if (strcmp(argv[1], "log") == 0) {
-        show_log(db_name);
-        return 0;
+    if (strcmp(argv[1], "batch") == 0) {
+        int nul = argc >= 3 && strcmp(argv[2], "-z") == 0;
+        return run_batch(&settings, db_name, nul ? '\0' : '\n');
+    }
+
+    if (is_repo_command(argv[1])) {
+        return run_repo_command(&settings, db_name, argc, argv);
     }
 
     print_help();
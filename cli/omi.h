@@ -0,0 +1,204 @@
+/*
+ * libomi - embeddable Omi repository API (C89)
+ *
+ * An OmiRepo handle owns one SQLite connection and a cache of prepared
+ * statements, so a program can run any number of operations against a
+ * repository without reopening it. Functions returning int return 1 on
+ * success and 0 on failure; omi_errmsg() describes the last failure.
+ * A handle must only be used by one thread at a time.
+ */
+
+#ifndef OMI_H
+#define OMI_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OMI_MAX_SMALL 128
+#define OMI_MAX_PATH 512
+
+/* SHA256 digest length; hashes are stored and returned as raw bytes */
+#define OMI_HASH_LEN 32
+
+typedef struct OmiSettings {
+    char username[OMI_MAX_SMALL];
+    char password[OMI_MAX_SMALL];
+    char repos[OMI_MAX_PATH];
+    char curl[OMI_MAX_SMALL];
+    char api_enabled[OMI_MAX_SMALL];
+    int use_internal_http;
+    int http_timeout;
+    /* 0 turns off compressed transfers */
+    int compression;
+    /* Longest delta chain between full copies of a path; 0 stores whole blobs */
+    int delta_chain;
+} OmiSettings;
+
+typedef struct OmiRepo OmiRepo;
+typedef struct OmiIter OmiIter;
+
+/* Strings in iterator rows stay valid until the next call on the iterator */
+typedef struct OmiCommit {
+    int id;
+    const char *message;
+    const char *datetime;
+    const char *user;
+} OmiCommit;
+
+typedef struct OmiFile {
+    const char *filename;
+    unsigned char hash[OMI_HASH_LEN];
+    const char *datetime;
+    int commit_id;
+} OmiFile;
+
+/* Partial clone filter for omi_pull: 0 / NULL fields are not sent */
+typedef struct OmiPullFilter {
+    long blob_limit;
+    const char *path_glob;
+} OmiPullFilter;
+
+/* Repository statistics (omi_stats). Byte totals are doubles so they stay
+ * exact past 4 GB on platforms with a 32-bit long. */
+#define OMI_STATS_MAX 50
+#define OMI_STATS_BUCKETS 40
+#define OMI_STATS_TABLES 16
+
+typedef struct OmiStatsBlob {
+    unsigned char hash[OMI_HASH_LEN];
+    double size;
+    long refs;
+    char path[OMI_MAX_PATH];
+} OmiStatsBlob;
+
+typedef struct OmiStatsPath {
+    char path[OMI_MAX_PATH];
+    long versions;
+    double bytes;
+} OmiStatsPath;
+
+/* New blobs first referenced by a commit, or by all commits of a user */
+typedef struct OmiStatsGrowth {
+    int commit_id;
+    char user[OMI_MAX_SMALL];
+    char datetime[32];
+    long commits;
+    long blobs;
+    double bytes;
+} OmiStatsGrowth;
+
+typedef struct OmiStatsTable {
+    char name[64];
+    long pages;
+    double bytes;
+    double unused;
+} OmiStatsTable;
+
+typedef struct OmiStats {
+    long blobs;
+    long unreferenced;
+    long file_versions;
+    long commits;
+    long promised;
+    double promised_bytes;
+    /* Blobs stored as deltas, the bytes their deltas take and the bytes
+     * that saves over storing them whole */
+    long delta_blobs;
+    double delta_bytes;
+    double delta_saved;
+    double logical_bytes;
+    /* After deltas; dedup_ratio is logical_bytes over the whole blobs */
+    double stored_bytes;
+    double dedup_ratio;
+    /* histogram[0] holds empty blobs, histogram[k] sizes in [2^(k-1), 2^k) */
+    long histogram_count[OMI_STATS_BUCKETS];
+    double histogram_bytes[OMI_STATS_BUCKETS];
+    OmiStatsBlob largest_blobs[OMI_STATS_MAX];
+    int largest_blob_count;
+    OmiStatsPath largest_paths[OMI_STATS_MAX];
+    int largest_path_count;
+    OmiStatsGrowth commit_growth[OMI_STATS_MAX];
+    int commit_growth_count;
+    OmiStatsGrowth user_growth[OMI_STATS_MAX];
+    int user_growth_count;
+    long page_size;
+    long page_count;
+    long freelist_count;
+    /* 1 when tables[] comes from dbstat, 0 when only page counts are known */
+    int pages_exact;
+    OmiStatsTable tables[OMI_STATS_TABLES];
+    int table_count;
+} OmiStats;
+
+/* Settings and working directory */
+void omi_settings_init(OmiSettings *s);
+void omi_settings_load(OmiSettings *s, const char *path);
+void omi_read_dotomi(char *out_db, size_t out_len);
+void omi_write_dotomi(const char *db_name);
+
+/* Messages go to stdout/stderr unless redirected; NULL silences a stream */
+void omi_set_output(FILE *info, FILE *err);
+void omi_hash_hex(const unsigned char *hash, char *out_hex, size_t out_len);
+
+/* Repository files. omi_init creates format 1 (hex TEXT hashes), which the
+ * web UI and every client share; format 2 (32-byte BLOB keys) is opt-in
+ * through omi_init_format or omi_migrate. Both formats are read and written. */
+int omi_init(const char *db_path);
+int omi_init_format(const char *db_path, int format);
+int omi_migrate(const char *db_path);
+
+/* Handles: db_path NULL uses the repository named in .omi, s NULL defaults */
+OmiRepo *omi_repo_open(const char *db_path, const OmiSettings *s);
+void omi_close(OmiRepo *repo);
+const char *omi_errmsg(const OmiRepo *repo);
+
+int omi_add(OmiRepo *repo, const char *path);
+int omi_add_all(OmiRepo *repo, const char *root);
+int omi_commit(OmiRepo *repo, const char *message, int *out_commit_id);
+
+/* Between begin and end, adds share one transaction that the next commit
+ * (or any other operation) ends; end saves adds not yet committed */
+int omi_batch_begin(OmiRepo *repo);
+int omi_batch_end(OmiRepo *repo);
+
+/* commit_id <= 0 means the latest commit */
+int omi_checkout(OmiRepo *repo, int commit_id, int *out_written, int *out_failed);
+int omi_cat(OmiRepo *repo, const char *path, int commit_id, FILE *out);
+int omi_fetch(OmiRepo *repo, long *out_fetched);
+
+/* Iterators: next returns 1 per row and 0 at the end */
+OmiIter *omi_commits(OmiRepo *repo);
+int omi_commit_next(OmiIter *it, OmiCommit *out);
+OmiIter *omi_files(OmiRepo *repo, int commit_id);
+OmiIter *omi_staged(OmiRepo *repo);
+int omi_file_next(OmiIter *it, OmiFile *out);
+/* 1 if the iterator could not be opened or next stopped on an error
+ * (see omi_errmsg) rather than at the last row */
+int omi_iter_failed(const OmiIter *it);
+void omi_iter_free(OmiIter *it);
+
+/* Called per line of omi_blame with the commit that wrote it; text is not
+ * NUL-terminated and excludes the newline. Return 0 to stop. */
+typedef int (*OmiBlameFn)(void *ctx, long line_no, const OmiCommit *origin, const char *text, size_t len);
+
+/* commit_id <= 0 blames the latest version. A version changing more than
+ * OMI_BLAME_MAX_EDIT (2048) line edits credits all its changed lines to its
+ * commit, with a note on the info stream (see omi_set_output). */
+int omi_blame(OmiRepo *repo, const char *path, int commit_id, OmiBlameFn fn, void *ctx);
+
+/* limit caps each list (at most OMI_STATS_MAX); full_pages runs dbstat even
+ * on repositories too large for it to be quick */
+int omi_stats(OmiRepo *repo, int limit, int full_pages, OmiStats *out);
+
+/* Server transfers of whole repository files */
+int omi_push(const OmiSettings *s, const char **db_paths, int count);
+int omi_pull(const OmiSettings *s, const char **db_paths, int count, const OmiPullFilter *filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Checks the C89 client against repositories created by other clients.
+# Usage: ./test_c89.sh [path/to/omi]   (default: build/c89/omi from build.sh)
+# Needs the sqlite3 command line tool.
+
+set -e
+
+ROOT_DIR="$(cd "$(dirname "$0")" && pwd)"
+OMI="${1:-$ROOT_DIR/build/c89/omi}"
+case "$OMI" in
+  /*) ;;
+  *) OMI="$(pwd)/$OMI" ;;
+esac
+WORK_DIR="$(mktemp -d)"
+failures=0
+
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+fail() {
+  echo "FAIL: $1"
+  failures=$((failures + 1))
+}
+
+# Schema of public/index.php and omi.lua: staging has no id column
+web_ui_repo() {
+  rm -rf "$WORK_DIR/$1"
+  mkdir -p "$WORK_DIR/$1"
+  cd "$WORK_DIR/$1"
+  sqlite3 web.omi "
+    CREATE TABLE IF NOT EXISTS blobs (hash TEXT PRIMARY KEY, data BLOB, size INTEGER);
+    CREATE TABLE IF NOT EXISTS files (id INTEGER PRIMARY KEY, filename TEXT, hash TEXT, datetime TEXT, commit_id INTEGER);
+    CREATE TABLE IF NOT EXISTS commits (id INTEGER PRIMARY KEY, message TEXT, datetime TEXT, user TEXT);
+    CREATE TABLE IF NOT EXISTS staging (filename TEXT PRIMARY KEY, hash TEXT, datetime TEXT);
+    CREATE INDEX IF NOT EXISTS idx_files_hash ON files(hash);
+    CREATE INDEX IF NOT EXISTS idx_files_commit ON files(commit_id);
+    CREATE INDEX IF NOT EXISTS idx_blobs_hash ON blobs(hash);"
+  echo 'OMI_DB="web.omi"' > .omi
+  echo "USERNAME=test" > settings.txt
+}
+
+test_web_ui_commit() {
+  web_ui_repo commit
+  echo "first" > a.txt
+  echo "second" > b.txt
+  "$OMI" add a.txt >/dev/null || fail "add a.txt into a web UI repository"
+  "$OMI" add b.txt >/dev/null || fail "add b.txt into a web UI repository"
+  "$OMI" commit -m "web ui" >/dev/null || fail "commit into a web UI repository"
+  [ "$(sqlite3 web.omi "SELECT group_concat(filename) FROM (SELECT filename FROM files WHERE commit_id = 1 ORDER BY id)")" = "a.txt,b.txt" ] \
+    || fail "committed files in staging order"
+  [ "$(sqlite3 web.omi "SELECT COUNT(*) FROM staging")" = "0" ] || fail "staging emptied by commit"
+  [ "$("$OMI" cat b.txt)" = "second" ] || fail "cat a file committed into a web UI repository"
+}
+
+test_web_ui_status() {
+  web_ui_repo status
+  echo "staged" > a.txt
+  "$OMI" add a.txt >/dev/null || fail "add into a web UI repository"
+  "$OMI" status > out.txt 2>&1 || fail "status of a web UI repository"
+  grep -q " a.txt$" out.txt || fail "status lists the staged file"
+  sqlite3 web.omi "DROP TABLE staging"
+  if "$OMI" status >/dev/null 2>&1; then
+    fail "status exits non-zero when staging cannot be read"
+  fi
+}
+
+test_web_ui_commit
+test_web_ui_status
+
+if [ "$failures" -gt 0 ]; then
+  echo "$failures check(s) failed"
+  exit 1
+fi
+echo "All checks passed"
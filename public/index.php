@@ -386,6 +386,77 @@ function getAPIRateInfo($username) {
     ];
 }
 
+// Short-lived API tokens, so CLI clients send the password once per token
+// lifetime instead of with every push/pull. Only SHA256 hashes are stored.
+define('API_TOKENS_FILE', __DIR__ . '/../api_tokens.txt');
+
+function getAPITokenLifetime() {
+    $settings = loadSettings();
+    $lifetime = intval($settings['API_TOKEN_LIFETIME'] ?? 3600);
+    return $lifetime > 0 ? $lifetime : 3600;
+}
+
+// Token file lines, read under a shared lock so a writer is never seen half done
+function readAPITokens() {
+    $fp = @fopen(API_TOKENS_FILE, 'r');
+    if ($fp === false) {
+        return [];
+    }
+    flock($fp, LOCK_SH);
+    $content = stream_get_contents($fp);
+    flock($fp, LOCK_UN);
+    fclose($fp);
+    return preg_split('/\R/', (string)$content, -1, PREG_SPLIT_NO_EMPTY);
+}
+
+function issueAPIToken($username) {
+    $token = bin2hex(random_bytes(32));
+    $expires = time() + getAPITokenLifetime();
+
+    // Read, prune and rewrite under one exclusive lock so concurrent logins
+    // cannot drop each other's tokens
+    $fp = fopen(API_TOKENS_FILE, 'c+');
+    if ($fp === false || !flock($fp, LOCK_EX)) {
+        return false;
+    }
+    @chmod(API_TOKENS_FILE, 0600);
+    $kept = '';
+    $lines = preg_split('/\R/', (string)stream_get_contents($fp), -1, PREG_SPLIT_NO_EMPTY);
+    foreach ($lines as $line) {
+        $parts = explode(':', $line);
+        if (count($parts) === 3 && intval($parts[2]) > time()) {
+            $kept .= $line . "\n";
+        }
+    }
+    $kept .= hashText($token) . ':' . $username . ':' . $expires . "\n";
+    ftruncate($fp, 0);
+    rewind($fp);
+    fwrite($fp, $kept);
+    fflush($fp);
+    flock($fp, LOCK_UN);
+    fclose($fp);
+    return ['token' => $token, 'expires' => $expires];
+}
+
+// Returns the username the token was issued to, or false
+function authenticateAPIToken($token) {
+    if (!is_string($token) || $token === '') {
+        return false;
+    }
+    $tokenHash = hashText($token);
+    foreach (readAPITokens() as $line) {
+        $parts = explode(':', $line);
+        if (count($parts) === 3 && hash_equals($parts[0], $tokenHash)) {
+            if (intval($parts[2]) <= time() || isUserLocked($parts[1])) {
+                return false;
+            }
+            $users = loadUsers();
+            return isset($users[$parts[1]]) ? $parts[1] : false;
+        }
+    }
+    return false;
+}
+
 // Clean up old API rate limit entries (older than 1 hour)
 function cleanupOldRateLimitEntries() {
     if (!file_exists(API_RATE_LIMIT_FILE)) {
@@ -966,14 +1037,33 @@ function organizeFiles($files, $basePath = '') {
     return $result;
 }
 
+// Hashes are hex text in format 1 repositories and raw 32-byte blobs in
+// format 2 ones (omi init --format=2 / omi migrate); both can be mixed
+function hashHex($hash) {
+    return strlen($hash) === 32 ? bin2hex($hash) : $hash;
+}
+
+// Bind a hash read from the files table so it keeps its storage class
+function bindHash($stmt, $pos, $hash) {
+    $stmt->bindValue($pos, $hash, strlen($hash) === 32 ? PDO::PARAM_LOB : PDO::PARAM_STR);
+}
+
+// Bind both forms of a hash for a "hash IN (?, ?)" lookup
+function bindHashKeys($stmt, $pos, $hash) {
+    $hex = hashHex($hash);
+    $stmt->bindValue($pos, $hex, PDO::PARAM_STR);
+    $stmt->bindValue($pos + 1, hex2bin($hex), PDO::PARAM_LOB);
+}
+
 // Get file content from blob
 function getFileContent($db, $hash) {
     try {
         $pdo = new PDO('sqlite:' . $db);
         $pdo->setAttribute(PDO::ATTR_ERRMODE, PDO::ERRMODE_EXCEPTION);
 
-        $stmt = $pdo->prepare("SELECT data FROM blobs WHERE hash = ?");
-        $stmt->execute([$hash]);
+        $stmt = $pdo->prepare("SELECT data FROM blobs WHERE hash IN (?, ?)");
+        bindHashKeys($stmt, 1, $hash);
+        $stmt->execute();
         $result = $stmt->fetch(PDO::FETCH_ASSOC);
 
         return $result ? $result['data'] : null;
@@ -982,6 +1072,143 @@ function getFileContent($db, $hash) {
     }
 }
 
+// Copy of a repository for a partial clone. Blobs larger than $blobLimit
+// (when >= 0) that do not belong to a path matching $pathFilter (a GLOB,
+// when set) are moved to the promised table and left on the server.
+function buildPartialRepository($repoPath, $blobLimit, $pathFilter) {
+    $tmp = tempnam(sys_get_temp_dir(), 'omi');
+    if ($tmp === false || !copy($repoPath, $tmp)) {
+        return null;
+    }
+    try {
+        $pdo = new PDO('sqlite:' . $tmp);
+        $pdo->setAttribute(PDO::ATTR_ERRMODE, PDO::ERRMODE_EXCEPTION);
+
+        $keep = [];
+        $params = [];
+        if ($blobLimit >= 0) {
+            $keep[] = 'size <= ?';
+            $params[] = $blobLimit;
+        }
+        if ($pathFilter !== '') {
+            $keep[] = 'hash IN (SELECT hash FROM files WHERE filename GLOB ?)';
+            $params[] = $pathFilter;
+        }
+
+        $pdo->exec('CREATE TABLE IF NOT EXISTS promised (hash BLOB PRIMARY KEY, size INTEGER) WITHOUT ROWID');
+        $stmt = $pdo->prepare('INSERT OR IGNORE INTO promised (hash, size) SELECT hash, size FROM blobs WHERE NOT (' . implode(' OR ', $keep) . ')');
+        $stmt->execute($params);
+        $pdo->exec('DELETE FROM blobs WHERE hash IN (SELECT hash FROM promised)');
+        $pdo->exec('VACUUM');
+        $pdo = null;
+        return $tmp;
+    } catch (Exception $e) {
+        @unlink($tmp);
+        return null;
+    }
+}
+
+// Small SQLite file holding only the requested blobs, for partial clones
+function buildBlobFetchFile($repoPath, $hexHashes) {
+    $tmp = tempnam(sys_get_temp_dir(), 'omi');
+    if ($tmp === false) {
+        return null;
+    }
+    try {
+        $pdo = new PDO('sqlite:' . $tmp);
+        $pdo->setAttribute(PDO::ATTR_ERRMODE, PDO::ERRMODE_EXCEPTION);
+        $pdo->exec('CREATE TABLE blobs (hash BLOB PRIMARY KEY, data BLOB, size INTEGER) WITHOUT ROWID');
+        $attach = $pdo->prepare('ATTACH DATABASE ? AS src');
+        $attach->execute([$repoPath]);
+
+        $placeholders = implode(',', array_fill(0, count($hexHashes), '?'));
+        $stmt = $pdo->prepare('INSERT OR IGNORE INTO blobs (hash, data, size) SELECT hash, data, size FROM src.blobs WHERE hash IN (' . $placeholders . ',' . $placeholders . ')');
+        foreach ($hexHashes as $i => $hex) {
+            $stmt->bindValue($i + 1, hex2bin($hex), PDO::PARAM_LOB);
+            $stmt->bindValue(count($hexHashes) + $i + 1, $hex, PDO::PARAM_STR);
+        }
+        $stmt->execute();
+        $pdo->exec('DETACH DATABASE src');
+        $pdo = null;
+        return $tmp;
+    } catch (Exception $e) {
+        @unlink($tmp);
+        return null;
+    }
+}
+
+// Compressed transfers. Downloads use a coding the client lists in
+// Accept-Encoding: zstd when the zstd extension is installed, else gzip.
+// The file is compressed chunk by chunk while it is sent. Uploads may be
+// gzipped (repo_encoding=gzip); API responses announce that with an
+// Accept-Encoding header (RFC 7694), so old clients and servers never see it.
+define('TRANSFER_CHUNK', 65536);
+define('TRANSFER_GZIP_LEVEL', 1);
+
+function pickContentEncoding() {
+    $accepted = [];
+    foreach (explode(',', strtolower($_SERVER['HTTP_ACCEPT_ENCODING'] ?? '')) as $item) {
+        $parts = array_map('trim', explode(';', $item));
+        if ($parts[0] !== '' && !in_array('q=0', $parts, true)) {
+            $accepted[] = $parts[0];
+        }
+    }
+    if (in_array('zstd', $accepted, true) && function_exists('zstd_compress_init')) return 'zstd';
+    if (in_array('gzip', $accepted, true) && function_exists('deflate_init')) return 'gzip';
+    return '';
+}
+
+function sendRepositoryFile($filepath) {
+    $encoding = pickContentEncoding();
+    header('Content-Type: application/octet-stream');
+    header('Vary: Accept-Encoding');
+    if ($encoding === '') {
+        header('Content-Length: ' . filesize($filepath));
+        readfile($filepath);
+        return;
+    }
+
+    // No Content-Length: the compressed size is known only at the end
+    ini_set('zlib.output_compression', 'Off');
+    header('Content-Encoding: ' . $encoding);
+    header('X-Omi-Raw-Length: ' . filesize($filepath));
+    $in = fopen($filepath, 'rb');
+    $ctx = ($encoding === 'zstd') ? zstd_compress_init() : deflate_init(ZLIB_ENCODING_GZIP, ['level' => TRANSFER_GZIP_LEVEL]);
+    while (!feof($in)) {
+        $chunk = fread($in, TRANSFER_CHUNK);
+        $out = ($encoding === 'zstd') ? zstd_compress_add($ctx, $chunk, false) : deflate_add($ctx, $chunk, ZLIB_NO_FLUSH);
+        if ($out !== '') {
+            echo $out;
+            flush();
+        }
+    }
+    echo ($encoding === 'zstd') ? zstd_compress_add($ctx, '', true) : deflate_add($ctx, '', ZLIB_FINISH);
+    fclose($in);
+}
+
+// Decompress a gzipped upload into place, through a temporary file
+function saveGzipUpload($uploadedPath, $targetPath) {
+    if (!is_uploaded_file($uploadedPath) || !function_exists('gzopen')) {
+        return false;
+    }
+    $in = gzopen($uploadedPath, 'rb');
+    $tmp = $targetPath . '.upload';
+    $out = fopen($tmp, 'wb');
+    $ok = ($in !== false && $out !== false);
+    while ($ok && !gzeof($in)) {
+        $chunk = gzread($in, TRANSFER_CHUNK);
+        $ok = ($chunk !== false && fwrite($out, $chunk) === strlen($chunk));
+    }
+    if ($in !== false) gzclose($in);
+    if ($out !== false) fclose($out);
+    if (!$ok || !rename($tmp, $targetPath)) {
+        @unlink($tmp);
+        return false;
+    }
+    @unlink($uploadedPath);
+    return true;
+}
+
 // Check if content is text
 function isTextFile($content) {
     if (empty($content)) return true;
@@ -1244,8 +1471,9 @@ function commitFile($db, $filename, $content) {
         $size = strlen($content);
 
         // Check if blob already exists
-        $stmt = $pdo->prepare("SELECT COUNT(*) as cnt FROM blobs WHERE hash = ?");
-        $stmt->execute([$hash]);
+        $stmt = $pdo->prepare("SELECT COUNT(*) as cnt FROM blobs WHERE hash IN (?, ?)");
+        bindHashKeys($stmt, 1, $hash);
+        $stmt->execute();
         $blobExists = $stmt->fetch(PDO::FETCH_ASSOC)['cnt'] > 0;
 
         // Insert blob if new
@@ -1275,7 +1503,11 @@ function commitFile($db, $filename, $content) {
 
             foreach ($existingFiles as $file) {
                 $stmt = $pdo->prepare("INSERT INTO files (filename, hash, datetime, commit_id) VALUES (?, ?, ?, ?)");
-                $stmt->execute([$file['filename'], $file['hash'], $file['datetime'], $commitId]);
+                $stmt->bindValue(1, $file['filename']);
+                bindHash($stmt, 2, $file['hash']);
+                $stmt->bindValue(3, $file['datetime']);
+                $stmt->bindValue(4, $commitId);
+                $stmt->execute();
             }
         }
 
@@ -1301,8 +1533,9 @@ function uploadFile($db, $filename, $content) {
         $size = strlen($content);
 
         // Check if blob already exists
-        $stmt = $pdo->prepare("SELECT COUNT(*) as cnt FROM blobs WHERE hash = ?");
-        $stmt->execute([$hash]);
+        $stmt = $pdo->prepare("SELECT COUNT(*) as cnt FROM blobs WHERE hash IN (?, ?)");
+        bindHashKeys($stmt, 1, $hash);
+        $stmt->execute();
         $blobExists = $stmt->fetch(PDO::FETCH_ASSOC)['cnt'] > 0;
 
         // Insert blob if new
@@ -1332,7 +1565,11 @@ function uploadFile($db, $filename, $content) {
 
             foreach ($existingFiles as $file) {
                 $stmt = $pdo->prepare("INSERT INTO files (filename, hash, datetime, commit_id) VALUES (?, ?, ?, ?)");
-                $stmt->execute([$file['filename'], $file['hash'], $file['datetime'], $commitId]);
+                $stmt->bindValue(1, $file['filename']);
+                bindHash($stmt, 2, $file['hash']);
+                $stmt->bindValue(3, $file['datetime']);
+                $stmt->bindValue(4, $commitId);
+                $stmt->execute();
             }
         }
 
@@ -1374,7 +1611,11 @@ function deleteFile($db, $filename) {
 
             foreach ($existingFiles as $file) {
                 $stmt = $pdo->prepare("INSERT INTO files (filename, hash, datetime, commit_id) VALUES (?, ?, ?, ?)");
-                $stmt->execute([$file['filename'], $file['hash'], $file['datetime'], $commitId]);
+                $stmt->bindValue(1, $file['filename']);
+                bindHash($stmt, 2, $file['hash']);
+                $stmt->bindValue(3, $file['datetime']);
+                $stmt->bindValue(4, $commitId);
+                $stmt->execute();
             }
         }
 
@@ -2392,8 +2633,9 @@ if (isset($_GET['image'])) {
         
         if ($fileRow) {
           // Get blob data
-          $blobStmt = $pdo->prepare('SELECT data FROM blobs WHERE hash = ?');
-          $blobStmt->execute([$fileRow['hash']]);
+          $blobStmt = $pdo->prepare('SELECT data FROM blobs WHERE hash IN (?, ?)');
+          bindHashKeys($blobStmt, 1, $fileRow['hash']);
+          $blobStmt->execute();
           $blobRow = $blobStmt->fetch(PDO::FETCH_ASSOC);
           
           if ($blobRow && $blobRow['data']) {
@@ -2550,7 +2792,7 @@ if (isset($_GET['image'])) {
 <?php if (isImageFile($repoPath)): ?>
 <!-- Image display for binary image files -->
 <p><strong>Binary file (<?php echo strlen($fileContent); ?> bytes)</strong></p>
-<p>Hash: <?php echo htmlspecialchars($fileHash); ?></p>
+<p>Hash: <?php echo htmlspecialchars(hashHex($fileHash)); ?></p>
 <hr>
 <p><b>Image File</b></p>
 <?php 
@@ -2575,7 +2817,7 @@ if (isset($_GET['image'])) {
 <p><small>Image file size: <?php echo number_format(strlen($fileContent)); ?> bytes</small></p>
 <?php else: ?>
 <p><strong>Binary file (<?php echo strlen($fileContent); ?> bytes)</strong></p>
-<p>Hash: <?php echo htmlspecialchars($fileHash); ?></p>
+<p>Hash: <?php echo htmlspecialchars(hashHex($fileHash)); ?></p>
 <?php endif; ?>
 <?php endif; ?>
 <?php endif; ?>
@@ -3072,6 +3314,9 @@ if (isset($_GET['image'])) {
 <tr><td><strong>Download repo:</strong></td><td>GET /?download=wekan.omi</td></tr>
 <tr><td><strong>Upload repo:</strong></td><td>POST with username, password, repo_name, repo_file</td></tr>
 <tr><td><strong>Pull changes:</strong></td><td>POST with username, password, action=pull, repo_name</td></tr>
+<tr><td><strong>Partial pull:</strong></td><td>action=pull with filter_blob_limit (bytes) and/or filter_path (GLOB)</td></tr>
+<tr><td><strong>Fetch blobs:</strong></td><td>POST with action=fetch_blobs, repo_name, hashes (comma-separated hex)</td></tr>
+<tr><td><strong>API token:</strong></td><td>POST with username, password, action=token; then send token instead of username/password</td></tr>
 </table>
 <hr>
 <p><small>Omi Server</small></p>
@@ -3086,6 +3331,17 @@ if ($_SERVER['REQUEST_METHOD'] === 'POST') {
     $password = $_POST['password'] ?? '';
     $otpCode = $_POST['otp_code'] ?? '';
     $action = $_POST['action'] ?? 'Upload';
+    $apiToken = $_POST['token'] ?? '';
+    $tokenUser = false;
+    if ($apiToken !== '') {
+        $tokenUser = authenticateAPIToken($apiToken);
+        if ($tokenUser === false) {
+            http_response_code(401);
+            echo json_encode(['error' => 'Invalid or expired token', 'token_invalid' => true]);
+            exit;
+        }
+        $username = $tokenUser;
+    }
 
     // Check if API is enabled
     $settings = loadSettings();
@@ -3119,7 +3375,7 @@ if ($_SERVER['REQUEST_METHOD'] === 'POST') {
     }
 
     // Authenticate
-    $authResult = authenticate($username, $password, $otpCode);
+    $authResult = ($tokenUser !== false) ? true : authenticate($username, $password, $otpCode);
 
     if ($authResult === 'OTP_REQUIRED') {
         http_response_code(401);
@@ -3141,6 +3397,26 @@ if ($_SERVER['REQUEST_METHOD'] === 'POST') {
     header('X-RateLimit-Limit: ' . intval($settings['API_RATE_LIMIT'] ?? 60));
     header('X-RateLimit-Remaining: ' . $rateInfo['remaining']);
     header('X-RateLimit-Reset: ' . $rateInfo['reset']);
+    if (function_exists('gzopen')) {
+        header('Accept-Encoding: gzip');
+    }
+
+    // Issue an API token; only a password login may create one
+    if ($action === 'token') {
+        if ($tokenUser !== false) {
+            http_response_code(400);
+            echo json_encode(['error' => 'Tokens must be requested with username and password']);
+            exit;
+        }
+        $issued = issueAPIToken($username);
+        if ($issued === false) {
+            http_response_code(500);
+            echo json_encode(['error' => 'Cannot store API token']);
+            exit;
+        }
+        echo json_encode(array_merge(['success' => true], $issued));
+        exit;
+    }
 
     // Handle upload
     if ($action === 'Upload' && isset($_FILES['repo_file'])) {
@@ -3157,11 +3433,16 @@ if ($_SERVER['REQUEST_METHOD'] === 'POST') {
         $target_path = REPOS_DIR . '/' . $repo_name;
 
         if ($upload_file['error'] === UPLOAD_ERR_OK) {
-            if (move_uploaded_file($upload_file['tmp_name'], $target_path)) {
+            $received = filesize($upload_file['tmp_name']);
+            $saved = (($_POST['repo_encoding'] ?? '') === 'gzip')
+                ? saveGzipUpload($upload_file['tmp_name'], $target_path)
+                : move_uploaded_file($upload_file['tmp_name'], $target_path);
+            if ($saved) {
                 echo json_encode([
                     'success' => true,
                     'message' => "Repository $repo_name uploaded successfully",
                     'size' => filesize($target_path),
+                    'received' => $received,
                     'rate_limit_remaining' => $rateInfo['remaining']
                 ]);
             } else {
@@ -3180,14 +3461,29 @@ if ($_SERVER['REQUEST_METHOD'] === 'POST') {
         $repo_name = basename($_POST['repo_name'] ?? '');
         $filepath = REPOS_DIR . '/' . $repo_name;
 
+        // Partial clone: send a filtered copy, large blobs become promised rows
+        $blobLimit = isset($_POST['filter_blob_limit']) ? intval($_POST['filter_blob_limit']) : -1;
+        $pathFilter = (string)($_POST['filter_path'] ?? '');
+        $partialPath = null;
+        if (file_exists($filepath) && ($blobLimit >= 0 || $pathFilter !== '')) {
+            $partialPath = buildPartialRepository($filepath, $blobLimit, $pathFilter);
+            if ($partialPath === null) {
+                http_response_code(500);
+                echo json_encode(['error' => 'Failed to build partial repository']);
+                exit;
+            }
+            $filepath = $partialPath;
+        }
+
         if (file_exists($filepath)) {
-            header('Content-Type: application/octet-stream');
             header('Content-Disposition: attachment; filename="' . $repo_name . '"');
-            header('Content-Length: ' . filesize($filepath));
             header('X-RateLimit-Limit: ' . intval($settings['API_RATE_LIMIT'] ?? 60));
             header('X-RateLimit-Remaining: ' . $rateInfo['remaining']);
             header('X-RateLimit-Reset: ' . $rateInfo['reset']);
-            readfile($filepath);
+            sendRepositoryFile($filepath);
+            if ($partialPath !== null) {
+                @unlink($partialPath);
+            }
             exit;
         } else {
             http_response_code(404);
@@ -3196,6 +3492,31 @@ if ($_SERVER['REQUEST_METHOD'] === 'POST') {
         }
     }
 
+    // Promised blobs of a partial clone, requested by hex hash
+    if ($action === 'fetch_blobs') {
+        $repo_name = basename($_POST['repo_name'] ?? '');
+        $filepath = REPOS_DIR . '/' . $repo_name;
+        $hashes = array_filter(explode(',', (string)($_POST['hashes'] ?? '')), function ($h) {
+            return preg_match('/^[0-9a-f]{64}$/i', $h) === 1;
+        });
+
+        if (!file_exists($filepath) || empty($hashes)) {
+            http_response_code(404);
+            echo json_encode(['error' => t('error', $translations)]);
+            exit;
+        }
+
+        $fetchPath = buildBlobFetchFile($filepath, array_slice(array_values($hashes), 0, 1000));
+        if ($fetchPath === null) {
+            http_response_code(500);
+            echo json_encode(['error' => 'Failed to read blobs']);
+            exit;
+        }
+        sendRepositoryFile($fetchPath);
+        @unlink($fetchPath);
+        exit;
+    }
+
     // Default response
     http_response_code(400);
     echo json_encode(['error' => 'Invalid action']);